@@ -0,0 +1,53 @@
+#!/bin/bash
+# End-to-end benchmark: builds both servers and the load generator, then runs
+# the same loadgen workload against server.cpp and each serverSelect engine
+# in turn, one fresh server per run.
+#
+#   ./bench.sh [loadgen options]          e.g. ./bench.sh --clients=1000 --rate=5
+#
+# BENCH_TARGETS picks the servers (default: server select epoll epoll-threads uring)
+# and BENCH_PORT the first port to use (default 47610).
+
+TARGETS=${BENCH_TARGETS:-"server select epoll epoll-threads uring"}
+PORT=${BENCH_PORT:-47610}
+CORES=$(nproc)
+BUILD=$(mktemp -d)
+trap 'rm -rf "$BUILD"' EXIT
+
+cd "$(dirname "$0")"
+g++ -O2 server.cpp -o "$BUILD/server" -lpthread &&
+    g++ -O2 serverSelect.cpp -o "$BUILD/serverSelect" -lpthread &&
+    g++ -O2 loadgen.cpp -o "$BUILD/loadgen" -lpthread || exit 1
+
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+# Large enough for any --clients the workload asks for.
+COMMON="--max-clients=100000 --log-level=warn"
+
+for target in $TARGETS; do
+    case $target in
+    server) command="$BUILD/server $PORT $COMMON" ;;
+    select) command="$BUILD/serverSelect $PORT $COMMON --engine=select" ;;
+    epoll) command="$BUILD/serverSelect $PORT $COMMON --engine=epoll" ;;
+    epoll-threads) command="$BUILD/serverSelect $PORT $COMMON --engine=epoll --threads=$CORES" ;;
+    uring) command="$BUILD/serverSelect $PORT $COMMON --engine=uring" ;;
+    *)
+        echo "unknown target $target"
+        continue
+        ;;
+    esac
+
+    $command >/dev/null &
+    server=$!
+    # Wait for the listening socket.
+    for _ in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+        sleep 0.1
+    done
+
+    echo "== $target"
+    "$BUILD/loadgen" 127.0.0.1 "$PORT" "$@"
+    kill "$server" 2>/dev/null
+    wait "$server" 2>/dev/null
+    PORT=$((PORT + 1))
+done
@@ -4,21 +4,22 @@
 #include <algorithm> // For std::find, std::remove, etc. (if needed)
 #include <string>    // For std::string
 #include <cstring>   // For memset(), strcpy(), etc.
+#include <map>       // For std::map
 
 // POSIX & System Libraries
 #include <unistd.h> // For close(), read(), write(), etc.
 #include <csignal>  // For handling signals (optional, if used)
+#include <poll.h>   // For poll()
 
 // Networking Libraries
 #include <sys/socket.h> // For socket functions (socket(), bind(), listen(), accept(), etc.)
 #include <netinet/in.h> // For sockaddr_in structure
 #include <netdb.h>      // For getaddrinfo(), gethostbyname(), etc.
 
-// Threading Library
-#include <pthread.h> // For pthreads (multithreading)
-
 // custom libraries for Chat Terminal
 #include "terminal.h"
+// Optional length-prefixed binary protocol
+#include "wireProtocol.h"
 
 using namespace std;
 
@@ -27,8 +28,6 @@ using namespace std;
 #define GREEN "\033[32m"  // Green color
 #define YELLOW "\033[33m" // Yellow color
 
-#define BUFFER_SIZE 4096
-
 terminal terminalObject;
 
 void leaveGracefully()
@@ -43,8 +42,10 @@ public:
     int portno, sockfd;
     struct sockaddr_in serv_addr;
     struct hostent *server;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytesRead, bytesSent;
+    bool binary = false;         // speak the binary protocol (--binary)
+    bool helloSeen = false;      // server has switched to frames
+    framer input;                // received bytes not yet shown
+    map<uint32_t, string> names; // sender id -> alias, from JOIN and MEMBER frames
 
     void getPort(char *argv[])
     {
@@ -93,84 +94,114 @@ public:
         close(sockfd);
     }
 
-    pair<ssize_t, string> recvAll()
+    // Reads whatever the server has sent without blocking. Returns bytes
+    // read, 0 when the server closed the connection or -1 on an error.
+    ssize_t readAvailable()
     {
-        string message = "";
-        const size_t CHUNK_SIZE = 32;
-        char chunk[CHUNK_SIZE];
-        ssize_t totalBytesRead = 0;
-
         while (true)
         {
-            bzero(chunk, CHUNK_SIZE);
-            ssize_t bytesRead = read(sockfd, chunk, CHUNK_SIZE - 1);
-
-            if (bytesRead < 0)
-            {
-                if (errno == EINTR)
-                    continue;    // Interrupted by signal, retry
-                return {-1, ""}; // Error occurred
-            }
-
-            if (bytesRead == 0)
-            {
-                // Connection closed by server
-                if (totalBytesRead == 0)
-                    return {0, ""};
-                break;
-            }
-
-            chunk[bytesRead] = '\0';
-            message.append(chunk);
-            totalBytesRead += bytesRead;
-
-            // Check if we've received a complete message (ending with newline)
-            if (message.find('\n') != string::npos)
-            {
-                break;
-            }
-        }
-
-        // Remove the trailing newline if present
-        if (!message.empty() && message.back() == '\n')
-        {
-            message.pop_back();
+            ssize_t bytesRead = input.fill(sockfd, MSG_DONTWAIT);
+            if (bytesRead < 0 && errno == EINTR)
+                continue; // Interrupted by signal, retry
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 1; // spurious wake-up; nothing lost
+            return bytesRead;
         }
-
-        return {totalBytesRead, message};
     }
 
     ssize_t sendAll(const string &message)
     {
-        const char *buffer = message.c_str();
-        size_t totalLength = message.length();
         size_t bytesSent = 0;
-        const size_t CHUNK_SIZE = 32;
-
-        while (bytesSent < totalLength)
+        while (bytesSent < message.size())
         {
-            size_t remainingBytes = totalLength - bytesSent;
-            size_t currentChunkSize = min(CHUNK_SIZE, remainingBytes);
-
-            ssize_t result = write(sockfd, buffer + bytesSent, currentChunkSize);
-
+            ssize_t result = write(sockfd, message.data() + bytesSent, message.size() - bytesSent);
             if (result < 0)
             {
                 if (errno == EINTR)
                     continue; // Interrupted by signal, retry
                 return -1;    // Error occurred
             }
-
             bytesSent += result;
         }
-
         return bytesSent;
     }
 
-    // Replace existing receiveMessage function with:
-    pair<ssize_t, string> recieveMessage()
+    string senderName(uint32_t id)
     {
-        return recvAll();
+        auto it = names.find(id);
+        return it != names.end() ? it->second : "#" + to_string(id);
+    }
+
+    // Turns a frame into the same text the server sends text clients.
+    string formatFrame(const wireFrame &frame)
+    {
+        string payload(frame.payload);
+        switch (frame.type)
+        {
+        case FRAME_BROADCAST:
+            return "[" + senderName(frame.sender) + ", to ALL] " + payload;
+        case FRAME_PRIVATE:
+            return "[" + senderName(frame.sender) + "] " + payload;
+        case FRAME_JOIN:
+            names[frame.sender] = payload;
+            return payload + " has joined the ChatRoom";
+        case FRAME_LEAVE:
+            names.erase(frame.sender);
+            return payload + " has left the ChatRoom";
+        case FRAME_MEMBER:
+            names[frame.sender] = payload;
+            return "";
+        case FRAME_NOTICE:
+        default:
+            return payload;
+        }
+    }
+
+    // Takes the next displayable message out of the received bytes. Returns
+    // 1, 0 if more bytes are needed, or -1 if the server sent a frame this
+    // client cannot decode. Until the server answers the hello it still
+    // speaks text, one line at a time; the answer may follow the unfinished
+    // "Enter Alias: " prompt on the same line. Heartbeat PINGs are answered
+    // here and never shown.
+    int nextMessage(string &message)
+    {
+        string_view view;
+        while (true)
+        {
+            if (!binary || !helloSeen)
+            {
+                if (!input.next(view))
+                    return 0;
+                if (binary && view.size() >= WIRE_HELLO.size() && view.substr(view.size() - WIRE_HELLO.size()) == WIRE_HELLO)
+                {
+                    helloSeen = true;
+                    view.remove_suffix(WIRE_HELLO.size());
+                    if (view.empty())
+                        continue;
+                }
+                if (view == WIRE_PING)
+                {
+                    sendAll(WIRE_PONG + "\n");
+                    continue;
+                }
+                message.assign(view);
+                return 1;
+            }
+            int status = input.nextSized(view, WIRE_MAX_FRAME);
+            if (status <= 0)
+                return status;
+            wireFrame frame;
+            if (!decodeFrame(view, frame))
+                return -1;
+            if (frame.type == FRAME_PING)
+            {
+                sendAll(encodeFrame(FRAME_PONG, 0, ""));
+                continue;
+            }
+            message = formatFrame(frame);
+            if (!message.empty())
+                return 1;
+        }
     }
 
     // Replace existing sendMessage function with:
@@ -180,63 +211,91 @@ public:
         {
             message += '\n'; // Add newline delimiter if not present
         }
+        if (binary)
+        {
+            message.pop_back();
+            return sendAll(encodeFrame(FRAME_LINE, 0, message));
+        }
         return sendAll(message);
     }
+
+    // Asks the server for the binary protocol; must be the first line sent.
+    void requestBinary()
+    {
+        binary = true;
+        sendAll(WIRE_HELLO + "\n");
+    }
 } clientObject;
 
-void *readHandler(void *args)
+// Shows every complete message received so far. Returns false once the
+// session is over.
+bool showMessages()
 {
-    pair<ssize_t, string> recieveReturn;
     string message;
-    ssize_t bytesRead;
+    int status;
+    while ((status = clientObject.nextMessage(message)) > 0)
+    {
+        terminalObject.consoleStatement(message);
+        if (message == "EXIT Processed")
+            return false;
+    }
+    if (status < 0)
+    {
+        terminalObject.consoleStatement("Malformed frame from Server");
+        return false;
+    }
+    return true;
+}
+
+// One thread waits on both the server socket and the keyboard, so a burst
+// of messages and typing are handled in the same loop and only this thread
+// ever touches ncurses.
+void eventLoop()
+{
+    struct pollfd fds[2];
+    fds[0].fd = clientObject.sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    string line;
+
     while (true)
     {
-        recieveReturn = clientObject.recieveMessage();
-        bytesRead = recieveReturn.first;
-        message = recieveReturn.second;
-        if (bytesRead < 0)
+        if (poll(fds, 2, terminalObject.frameTimeout()) < 0 && errno != EINTR)
         {
-            terminalObject.consoleStatement("Error in Reading");
-        }
-        else if (bytesRead == 0)
-        {
-            terminalObject.consoleStatement("Disconnecting from Server");
+            terminalObject.consoleStatement("Error in Polling");
             break;
         }
-        else
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
         {
-            terminalObject.consoleStatement(message);
-            if (message == "EXIT Processed")
+            ssize_t bytesRead = clientObject.readAvailable();
+            if (bytesRead < 0)
             {
+                terminalObject.consoleStatement("Error in Reading");
+                break;
+            }
+            if (!showMessages())
+                break;
+            if (bytesRead == 0)
+            {
+                terminalObject.consoleStatement("Disconnecting from Server");
                 break;
             }
         }
-    }
-    pthread_exit(NULL);
-}
-
-void *writeHandler(void *args)
-{
-    string message;
-    while (true)
-    {
-        message = terminalObject.getInput();
-        message += "\n";
-        if (sizeof(message) > BUFFER_SIZE)
+        if (fds[1].revents & POLLIN)
         {
-            message[BUFFER_SIZE - 2] = '\n';
+            while (terminalObject.pollInput(line))
+                clientObject.sendMessage(line);
         }
-        clientObject.sendMessage(message);
-        message.pop_back();
+        terminalObject.renderIfDue();
     }
-    pthread_exit(NULL);
 }
 
 int main(int argc, char *argv[])
 {
     if (argc < 3)
     {
-        fprintf(stderr, "usage %s hostname port\n", argv[0]);
+        fprintf(stderr, "usage %s hostname port [--binary] [--history-file=PATH]\n", argv[0]);
         exit(0);
     }
     clientObject.getPort(argv);
@@ -244,15 +303,17 @@ int main(int argc, char *argv[])
     clientObject.getServer(argv);
     clientObject.initServer();
     clientObject.connectServer();
+    for (int i = 3; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--binary")
+            clientObject.requestBinary();
+        else if (arg.rfind("--history-file=", 0) == 0)
+            terminalObject.spillTo(arg.substr(strlen("--history-file=")));
+    }
 
     terminalObject.initNcurses();
-
-    pthread_t readThread, writeThread;
-    pthread_create(&readThread, NULL, readHandler, NULL);
-    pthread_create(&writeThread, NULL, writeHandler, NULL);
-    pthread_detach(writeThread);
-    pthread_join(readThread, NULL);
-    pthread_cancel(writeThread);
+    eventLoop();
 
     clientObject.closeClient();
     terminalObject.closeTerminal();
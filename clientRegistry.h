@@ -0,0 +1,319 @@
+#ifndef CLIENT_REGISTRY_H
+#define CLIENT_REGISTRY_H
+
+// Aliases and chat rooms shared by every worker thread.
+//
+// Aliases and room names are split into shards by hash. A shard's mutex is
+// only taken to claim or release an alias or to create a room, so clients
+// with different aliases rarely contend. Each room has its own writer lock
+// and publishes its members read-copy-update style: an immutable member list
+// that a joining or leaving client copies, changes and swaps in. Readers such
+// as broadcast() walk the current list without any lock; they only announce
+// the epoch they started in, and a replaced list is freed once no reader can
+// still be walking it. Work per message is proportional to the size of the
+// sender's room, and rooms never contend with each other.
+//
+// Every alias gets an integer user id: its index in its shard's userTable
+// times REGISTRY_SHARDS plus the shard number, so the id alone leads back to
+// the shard and entry. Workers keep their client's alias, id and room in a
+// table indexed by socket and never look any of them up by name on the
+// message path.
+//
+// A socket found in a roster or by alias may be closed, and its descriptor
+// reused, before the message reaches it. Every socket therefore travels with
+// the generation of its connection, which the server checks before queuing.
+
+#include <string>      // For std::string
+#include <vector>      // For std::vector
+#include <string_view> // For std::string_view
+#include <atomic>      // For std::atomic
+#include <cstdint>     // For uint64_t
+#include <pthread.h>   // For pthread_mutex_t
+
+#include "fdTable.h"
+#include "userTable.h"
+#include "roomHistory.h"
+#include "rateLimiter.h"
+#include "presence.h"
+
+using namespace std;
+
+#define REGISTRY_SHARDS 16
+
+// A connection: its socket and the generation that tells it apart from a
+// later connection on the same descriptor.
+struct connectionRef
+{
+    int sock = -1;
+    unsigned generation = 0;
+};
+
+struct roomMember
+{
+    int sock;
+    userId id;
+    string alias;
+    unsigned generation; // of the connection on sock
+};
+
+typedef vector<roomMember> roster;
+
+// Rooms are created on first JOIN and never freed, so a worker may keep a
+// pointer to one without holding any lock.
+struct chatRoom
+{
+    string name;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER; // writers only
+    atomic<const roster *> members{new roster()};
+    roomHistory history; // has its own lock
+    sharedBucket rate;   // --room-rate, charged by any worker
+    presenceBatch presence; // joins and leaves not yet announced; guarded by the server's presenceMutex
+};
+
+// What the worker serving a socket knows about its client.
+struct clientName
+{
+    string alias;
+    userId id = NO_USER;
+    unsigned generation = 0;
+    chatRoom *room = NULL;
+};
+
+class clientRegistry
+{
+private:
+    struct shard
+    {
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        userTable<connectionRef> users; // connection while in a room, else sock -1
+        userTable<chatRoom *> rooms; // rooms whose names hash here
+    };
+
+    // One per thread that has ever read a room; epoch is 0 outside a read.
+    struct readerSlot
+    {
+        atomic<uint64_t> epoch{0};
+        int depth = 0; // nested reads, touched only by the owning thread
+        readerSlot *next = NULL;
+    };
+
+    struct retiredRoster
+    {
+        const roster *members;
+        uint64_t epoch; // readers that entered before this may still use it
+    };
+
+    shard shards[REGISTRY_SHARDS];
+    fdTable<clientName> names; // per socket, written by the owning worker
+    atomic<uint64_t> globalEpoch{1};
+    atomic<readerSlot *> readers{NULL};
+    size_t historyMessages = HISTORY_DEFAULT_MESSAGES; // per new room
+    pthread_mutex_t retiredMutex = PTHREAD_MUTEX_INITIALIZER;
+    vector<retiredRoster> retired; // guarded by retiredMutex
+
+    // The same FNV-1a as userTable, but the shard comes from the high bits so
+    // that the low bits still spread one shard's names over its slots.
+    static size_t shardOf(string_view name)
+    {
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : name)
+            hash = (hash ^ c) * 16777619u;
+        return (hash >> 16) % REGISTRY_SHARDS;
+    }
+
+    readerSlot *mySlot()
+    {
+        static thread_local clientRegistry *owner = NULL;
+        static thread_local readerSlot *slot = NULL;
+        if (owner != this)
+        {
+            slot = new readerSlot();
+            readerSlot *head = readers.load();
+            do
+                slot->next = head;
+            while (!readers.compare_exchange_weak(head, slot));
+            owner = this;
+        }
+        return slot;
+    }
+
+    void beginRead()
+    {
+        readerSlot *slot = mySlot();
+        if (slot->depth++ == 0)
+            slot->epoch.store(globalEpoch.load());
+    }
+
+    void endRead()
+    {
+        readerSlot *slot = mySlot();
+        if (--slot->depth == 0)
+            slot->epoch.store(0);
+    }
+
+    // Swaps in a room's new member list and frees the lists no reader can
+    // still hold. Called with the room's mutex held.
+    void publish(chatRoom &room, const roster *fresh)
+    {
+        const roster *old = room.members.exchange(fresh);
+        uint64_t retireEpoch = globalEpoch.fetch_add(1) + 1;
+
+        uint64_t oldestReader = UINT64_MAX;
+        for (readerSlot *slot = readers.load(); slot != NULL; slot = slot->next)
+        {
+            uint64_t epoch = slot->epoch.load();
+            if (epoch != 0 && epoch < oldestReader)
+                oldestReader = epoch;
+        }
+
+        pthread_mutex_lock(&retiredMutex);
+        retired.push_back({old, retireEpoch});
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); i++)
+        {
+            if (retired[i].epoch <= oldestReader)
+                delete retired[i].members;
+            else
+                retired[kept++] = retired[i];
+        }
+        retired.resize(kept);
+        pthread_mutex_unlock(&retiredMutex);
+    }
+
+    // Records in the alias shard which connection a user is in a room with,
+    // for findMember(); sock -1 once it has left.
+    void setMemberSocket(userId id, connectionRef connection)
+    {
+        shard &s = shards[id % REGISTRY_SHARDS];
+        pthread_mutex_lock(&s.mutex);
+        s.users[id / REGISTRY_SHARDS] = connection;
+        pthread_mutex_unlock(&s.mutex);
+    }
+
+public:
+    void init(int maxDescriptors, size_t roomHistoryMessages)
+    {
+        names.init(maxDescriptors);
+        historyMessages = roomHistoryMessages;
+    }
+
+    // Assigns an alias to the connection on a socket unless another client
+    // already has it.
+    bool claimAlias(int sock, const string &alias, unsigned generation)
+    {
+        size_t index = shardOf(alias);
+        shard &s = shards[index];
+        pthread_mutex_lock(&s.mutex);
+        userId local = s.users.add(alias, connectionRef());
+        pthread_mutex_unlock(&s.mutex);
+        if (local == NO_USER)
+            return false;
+        names[sock].alias = alias;
+        names[sock].id = local * REGISTRY_SHARDS + index;
+        names[sock].generation = generation;
+        return true;
+    }
+
+    void releaseAlias(int sock)
+    {
+        clientName &name = names[sock];
+        if (name.id == NO_USER)
+            return;
+        shard &s = shards[name.id % REGISTRY_SHARDS];
+        pthread_mutex_lock(&s.mutex);
+        s.users.remove(name.id / REGISTRY_SHARDS);
+        pthread_mutex_unlock(&s.mutex);
+        name = clientName();
+    }
+
+    // Alias, user id and room of a socket; only meaningful to the thread
+    // serving that client.
+    const string &alias(int sock)
+    {
+        return names[sock].alias;
+    }
+
+    userId id(int sock)
+    {
+        return names[sock].id;
+    }
+
+    chatRoom *roomOf(int sock)
+    {
+        return names[sock].room;
+    }
+
+    // Returns the room with this name, creating it on first use.
+    chatRoom *openRoom(string_view name)
+    {
+        shard &s = shards[shardOf(name)];
+        pthread_mutex_lock(&s.mutex);
+        roomId id = s.rooms.find(name);
+        if (id == NO_ROOM)
+        {
+            chatRoom *fresh = new chatRoom();
+            fresh->name = string(name);
+            fresh->history.init(fresh->name, historyMessages);
+            id = s.rooms.add(fresh->name, fresh);
+        }
+        chatRoom *room = s.rooms[id];
+        pthread_mutex_unlock(&s.mutex);
+        return room;
+    }
+
+    void join(int sock, chatRoom *room)
+    {
+        clientName &name = names[sock];
+        setMemberSocket(name.id, {sock, name.generation});
+        pthread_mutex_lock(&room->mutex);
+        roster *fresh = new roster(*room->members.load());
+        fresh->push_back({sock, name.id, name.alias, name.generation});
+        publish(*room, fresh);
+        pthread_mutex_unlock(&room->mutex);
+        name.room = room;
+    }
+
+    void leave(int sock)
+    {
+        clientName &name = names[sock];
+        chatRoom *room = name.room;
+        if (room == NULL)
+            return;
+        setMemberSocket(name.id, connectionRef());
+        pthread_mutex_lock(&room->mutex);
+        roster *fresh = new roster();
+        const roster *current = room->members.load();
+        fresh->reserve(current->size());
+        for (const roomMember &member : *current)
+            if (member.sock != sock)
+                fresh->push_back(member);
+        publish(*room, fresh);
+        pthread_mutex_unlock(&room->mutex);
+        name.room = NULL;
+    }
+
+    // Calls visit(const roomMember &) for everyone in the room as of the
+    // start of the walk. Takes no locks.
+    template <typename F>
+    void forEachMember(chatRoom *room, F visit)
+    {
+        beginRead();
+        for (const roomMember &member : *room->members.load())
+            visit(member);
+        endRead();
+    }
+
+    // Looks up a user in any room by alias. Returns false if the alias is
+    // unknown or not in a room.
+    bool findMember(string_view alias, connectionRef &connection)
+    {
+        shard &s = shards[shardOf(alias)];
+        pthread_mutex_lock(&s.mutex);
+        userId local = s.users.find(alias);
+        connection = (local != NO_USER) ? s.users[local] : connectionRef();
+        pthread_mutex_unlock(&s.mutex);
+        return connection.sock >= 0;
+    }
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+// Classifies a chat line and walks its @mentions without copying or
+// allocating: every result is a string_view into the line itself. A line is
+// read once; for a private message the mentions are consumed one by one with
+// nextMention(), after which what remains is the body.
+//
+//   "CONNECT..." / "DISCONNECT..." / "EXIT..."   commands (prefix match)
+//   "JOIN team" / "LEAVE"                       switch to room "team" / leave the room
+//   "CONNECT since 42" / "JOIN team since 42"   join, replaying only messages after #42
+//   "STATS"                                     server statistics for the sender
+//   "WHO" / "WHO 2"                             first / second page of the room's members
+//   "@alice @bob hi"                            PRIVATE to alice and bob, body "hi"
+//   anything else                               BROADCAST of the whole line
+//
+// CONNECT is JOIN of DEFAULT_ROOM and DISCONNECT is LEAVE, so older clients
+// keep working unchanged.
+
+#include <string_view> // For std::string_view
+#include <algorithm>   // For std::min, std::max
+#include <cstdint>     // For uint64_t
+
+using namespace std;
+
+#define DEFAULT_ROOM "general"
+#define MAX_ROOM_NAME 32
+
+enum msgType
+{
+    BROADCAST,
+    CONNECT,
+    DISCONNECT,
+    PRIVATE,
+    EXIT,
+    JOIN,
+    LEAVE,
+    STATS,
+    WHO
+};
+
+struct parsedCommand
+{
+    msgType command = BROADCAST;
+    // PRIVATE: the mentions followed by the body. JOIN: the room name, empty
+    // if it is missing or too long. Otherwise the whole line.
+    string_view rest;
+    // CONNECT and JOIN: replay the room's messages after this one (0: all).
+    uint64_t since = 0;
+    // WHO: roster page, from 1.
+    size_t page = 1;
+};
+
+inline bool startsWith(string_view line, string_view prefix)
+{
+    return line.size() >= prefix.size() && line.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Reads an optional "since N" from what follows a CONNECT or JOIN.
+inline uint64_t parseSince(string_view tail)
+{
+    size_t at = tail.find("since ");
+    if (at == string_view::npos)
+        return 0;
+    uint64_t since = 0;
+    for (size_t i = at + 6; i < tail.size() && tail[i] >= '0' && tail[i] <= '9'; i++)
+        since = since * 10 + (tail[i] - '0');
+    return since;
+}
+
+inline parsedCommand parseCommand(string_view line)
+{
+    parsedCommand parsed;
+    parsed.rest = line;
+    if (!line.empty() && line[0] == '@')
+        parsed.command = PRIVATE;
+    else if (startsWith(line, "CONNECT"))
+    {
+        parsed.command = CONNECT;
+        parsed.since = parseSince(line.substr(7));
+    }
+    else if (startsWith(line, "DISCONNECT"))
+        parsed.command = DISCONNECT;
+    else if (startsWith(line, "EXIT"))
+        parsed.command = EXIT;
+    else if (line == "LEAVE")
+        parsed.command = LEAVE;
+    else if (line == "STATS")
+        parsed.command = STATS;
+    else if (line == "WHO" || startsWith(line, "WHO "))
+    {
+        parsed.command = WHO;
+        size_t page = 0;
+        for (size_t i = 3; i < line.size(); i++)
+            if (line[i] >= '0' && line[i] <= '9')
+                page = page * 10 + (line[i] - '0');
+        parsed.page = max<size_t>(page, 1);
+    }
+    else if (line == "JOIN" || startsWith(line, "JOIN "))
+    {
+        parsed.command = JOIN;
+        string_view name = line.substr(4);
+        name.remove_prefix(min(name.find_first_not_of(' '), name.size()));
+        parsed.since = parseSince(name.substr(min(name.find(' '), name.size())));
+        name = name.substr(0, name.find(' '));
+        parsed.rest = (name.size() <= MAX_ROOM_NAME) ? name : string_view();
+    }
+    return parsed;
+}
+
+// Takes the next "@alias " off the front of rest. Returns false once rest no
+// longer starts with '@'; rest is then the message body.
+inline bool nextMention(string_view &rest, string_view &alias)
+{
+    if (rest.empty() || rest[0] != '@')
+        return false;
+    size_t end = rest.find(' ', 1);
+    if (end == string_view::npos)
+        end = rest.size();
+    alias = rest.substr(1, end - 1);
+    rest.remove_prefix(end < rest.size() ? end + 1 : end);
+    return true;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef FD_TABLE_H
+#define FD_TABLE_H
+
+// Table of per-socket state indexed by file descriptor. Entries are created in
+// chunks and never move or get freed, so one thread can add a socket while
+// others keep references to theirs, and a late event for a closed socket never
+// touches freed memory.
+
+#include <atomic> // For std::atomic
+
+using namespace std;
+
+template <typename T>
+class fdTable
+{
+private:
+    static const int CHUNK_SIZE = 1024;
+    int maxChunks = 0;
+    atomic<T *> *chunks = NULL;
+
+public:
+    void init(int maxDescriptors)
+    {
+        maxChunks = (maxDescriptors + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        chunks = new atomic<T *>[maxChunks];
+        for (int i = 0; i < maxChunks; i++)
+            chunks[i] = NULL;
+    }
+
+    bool fits(int fd)
+    {
+        return fd >= 0 && fd < maxChunks * CHUNK_SIZE;
+    }
+
+    bool contains(int fd)
+    {
+        return fits(fd) && chunks[fd / CHUNK_SIZE].load(memory_order_acquire) != NULL;
+    }
+
+    T &operator[](int fd)
+    {
+        T *chunk = chunks[fd / CHUNK_SIZE].load(memory_order_acquire);
+        if (chunk == NULL)
+        {
+            T *fresh = new T[CHUNK_SIZE];
+            if (chunks[fd / CHUNK_SIZE].compare_exchange_strong(chunk, fresh))
+                chunk = fresh;
+            else
+                delete[] fresh; // another thread created it first
+        }
+        return chunk[fd % CHUNK_SIZE];
+    }
+};
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+// Per-connection receive buffer that splits a byte stream into
+// newline-delimited messages. Bytes live in a ring, are read with one large
+// recvmsg() per call and are scanned for '\n' 16/32 bytes at a time; every
+// complete message in the ring is handed out, not just the first one.
+// nextSized() splits length-prefixed records instead (wireProtocol.h).
+//
+// A message may be at most `limit` bytes. A longer line is never buffered
+// whole: once `limit` bytes without a '\n' are waiting, the framer either
+// hands them out as a message of their own and carries on (OVERSIZE_SPLIT)
+// or throws them away, and everything up to the next '\n' as it arrives
+// (OVERSIZE_REJECT), counting it in takeRejected(). The ring therefore never
+// grows past capacityFor(limit), which caps a connection's input memory.
+
+#include <string>      // For std::string
+#include <string_view> // For std::string_view
+#include <vector>      // For std::vector
+#include <algorithm>   // For std::min, std::max
+#include <cstring>     // For memchr(), memcpy()
+#include <cerrno>      // For errno, ENOBUFS
+#include <sys/socket.h> // For recvmsg()
+#include <sys/uio.h>    // For struct iovec
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h> // For SSE2/AVX2 intrinsics
+#endif
+
+using namespace std;
+
+#define FRAMER_INITIAL_CAPACITY 16384 // bytes, grows by doubling
+#define FRAMER_DEFAULT_LIMIT (1 << 16) // longest message when none is set
+
+enum oversizePolicy
+{
+    OVERSIZE_REJECT, // drop the whole line
+    OVERSIZE_SPLIT   // deliver it in limit-sized pieces
+};
+
+// Returns the offset of the first '\n' in [data, data + length) or `length`.
+inline size_t findNewline(const char *data, size_t length)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i newline32 = _mm256_set1_epi8('\n');
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline32));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i newline16 = _mm_set1_epi8('\n');
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline16));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    const char *found = (const char *)memchr(data + i, '\n', length - i);
+    return found ? found - data : length;
+}
+
+class framer
+{
+private:
+    vector<char> ring;  // allocated on first use; size is a power of two
+    size_t head = 0;    // first unconsumed byte (monotonic, masked on access)
+    size_t tail = 0;    // one past the last received byte
+    size_t scanned = 0; // bytes before this position hold no '\n'
+    string scratch;     // holds a message that wraps around the ring end
+    size_t limit = FRAMER_DEFAULT_LIMIT;
+    oversizePolicy policy = OVERSIZE_REJECT;
+    bool discarding = false; // rejecting the rest of an oversized line
+    size_t rejected = 0;     // oversized lines dropped, not yet reported
+
+    size_t mask() const
+    {
+        return ring.size() - 1;
+    }
+
+    // Doubles the ring, unwrapping its contents to the start.
+    void grow()
+    {
+        size_t used = tail - head;
+        vector<char> bigger(ring.empty() ? FRAMER_INITIAL_CAPACITY : ring.size() * 2);
+        for (size_t i = 0; i < used; i++)
+            bigger[i] = ring[(head + i) & mask()];
+        scanned -= head;
+        head = 0;
+        tail = used;
+        ring.swap(bigger);
+    }
+
+    // Points message at `length` bytes from head, then consumes them and
+    // `skip` more (the '\n').
+    void take(string_view &message, size_t length, size_t skip)
+    {
+        size_t first = head & mask();
+        if (first + length <= ring.size())
+        {
+            message = string_view(&ring[first], length);
+        }
+        else
+        {
+            size_t before = ring.size() - first;
+            scratch.assign(&ring[first], before);
+            scratch.append(&ring[0], length - before);
+            message = scratch;
+        }
+        head += length + skip;
+        scanned = max(scanned, head);
+    }
+
+    // Free space as at most two contiguous spans; none once the ring is full
+    // at its cap.
+    int freeSpans(struct iovec spans[2])
+    {
+        if (tail - head == ring.size())
+        {
+            if (ring.size() >= capacityFor(limit))
+                return 0;
+            grow();
+        }
+        size_t start = tail & mask();
+        size_t freeBytes = ring.size() - (tail - head);
+        size_t first = min(freeBytes, ring.size() - start);
+        spans[0].iov_base = &ring[start];
+        spans[0].iov_len = first;
+        if (first == freeBytes)
+            return 1;
+        spans[1].iov_base = &ring[0];
+        spans[1].iov_len = freeBytes - first;
+        return 2;
+    }
+
+public:
+    // Largest ring a framer with this limit uses: room for a whole message
+    // (or length-prefixed record) and as much again of what follows it.
+    static size_t capacityFor(size_t limit)
+    {
+        size_t capacity = FRAMER_INITIAL_CAPACITY;
+        while (capacity < 2 * (limit + 64))
+            capacity *= 2;
+        return capacity;
+    }
+
+    void setLimit(size_t maxMessage, oversizePolicy oversize)
+    {
+        limit = maxMessage;
+        policy = oversize;
+    }
+
+    // True when the ring is at its cap with no free space: the caller must
+    // take messages out before it can fill() again.
+    bool full() const
+    {
+        return !ring.empty() && tail - head == ring.size() && ring.size() >= capacityFor(limit);
+    }
+
+    // Oversized lines dropped since the last call.
+    size_t takeRejected()
+    {
+        size_t count = rejected;
+        rejected = 0;
+        return count;
+    }
+
+    // One recvmsg() into all free space. Returns bytes read, 0 when the peer
+    // closed the connection or -1 with errno set (EAGAIN on an empty
+    // non-blocking socket, ENOBUFS if full()). flags is passed to recvmsg(),
+    // e.g. MSG_DONTWAIT.
+    ssize_t fill(int sock, int flags = 0)
+    {
+        struct iovec spans[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = spans;
+        msg.msg_iovlen = freeSpans(spans);
+        if (msg.msg_iovlen == 0)
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+        ssize_t bytesRead = recvmsg(sock, &msg, flags);
+        if (bytesRead > 0)
+            tail += bytesRead;
+        return bytesRead;
+    }
+
+    // Adds bytes that were received elsewhere (e.g. an io_uring buffer).
+    // Returns how many fit; the caller takes messages out and appends the
+    // rest.
+    size_t append(const char *bytes, size_t length)
+    {
+        size_t added = 0;
+        struct iovec spans[2];
+        int count = freeSpans(spans);
+        for (int i = 0; i < count && added < length; i++)
+        {
+            size_t n = min(length - added, spans[i].iov_len);
+            memcpy(spans[i].iov_base, bytes + added, n);
+            added += n;
+            tail += n;
+        }
+        return added;
+    }
+
+    // Extracts the next complete message without its '\n'. The view stays
+    // valid until the next call on this framer. Oversized lines are split or
+    // dropped here, as the policy says.
+    bool next(string_view &message)
+    {
+        while (true)
+        {
+            size_t end = tail; // position of the next '\n', or tail
+            while (scanned < tail)
+            {
+                size_t start = scanned & mask();
+                size_t span = min(tail - scanned, ring.size() - start);
+                size_t offset = findNewline(&ring[start], span);
+                if (offset < span)
+                {
+                    end = scanned + offset;
+                    break;
+                }
+                scanned += span;
+            }
+
+            if (discarding)
+            {
+                // The tail of a rejected line: forget it up to its '\n'.
+                head = scanned = min(end + 1, tail);
+                if (end == tail)
+                    return false;
+                discarding = false;
+                continue;
+            }
+            if (end - head <= limit && end < tail)
+            {
+                take(message, end - head, 1);
+                return true;
+            }
+            if (end - head <= limit)
+                return false; // an incomplete line, still short enough
+
+            if (policy == OVERSIZE_SPLIT)
+            {
+                take(message, limit, 0);
+                scanned = head;
+                return true;
+            }
+            rejected++;
+            discarding = true;
+        }
+    }
+
+    // Extracts the next record of a length-prefixed stream: a 4-byte
+    // big-endian length followed by that many bytes, which are returned
+    // without the prefix. Returns 1 for a record, 0 if it is incomplete and
+    // -1 if the length exceeds maxLength. The view is valid as for next().
+    int nextSized(string_view &record, size_t maxLength)
+    {
+        size_t available = tail - head;
+        if (available < 4)
+            return 0;
+        unsigned char prefix[4];
+        for (int i = 0; i < 4; i++)
+            prefix[i] = ring[(head + i) & mask()];
+        size_t length = ((size_t)prefix[0] << 24) | ((size_t)prefix[1] << 16) | ((size_t)prefix[2] << 8) | prefix[3];
+        if (length > min(maxLength, limit + 64))
+            return -1;
+        if (available < 4 + length)
+            return 0;
+
+        size_t first = (head + 4) & mask();
+        if (first + length <= ring.size())
+        {
+            record = string_view(&ring[first], length);
+        }
+        else
+        {
+            size_t before = ring.size() - first;
+            scratch.assign(&ring[first], before);
+            scratch.append(&ring[0], length - before);
+            record = scratch;
+        }
+        head += 4 + length;
+        scanned = max(scanned, head); // no newline scanning in this mode
+        return 1;
+    }
+
+    size_t buffered() const
+    {
+        return tail - head;
+    }
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+// Liveness checks for client connections. A half-open TCP connection (the
+// peer's machine died or its network went away) never makes read() fail, so
+// the servers ask: a client that has sent nothing for --ping-interval seconds
+// gets a PING (WIRE_PING, or a FRAME_PING to binary clients) and must answer
+// within --ping-timeout seconds. Anything it sends counts as an answer; the
+// clients send WIRE_PONG. One that stays silent is disconnected.
+// --idle-timeout also disconnects clients that answer pings but have sent
+// no message of their own for that long.
+//
+// Both are off unless asked for: a netcat user or an older client that never
+// answers a PING would otherwise be dropped after a quiet spell.
+//
+// Each connection has one timer in its event loop's timingWheel, set to the
+// next moment one of these can fire. Receiving only stores the current tick
+// in the connection's heartbeat; the timer finds out when it goes off and
+// sets itself again, so a busy client costs no timer work per message.
+
+#include <atomic>    // For std::atomic
+#include <algorithm> // For std::min
+#include <cstdint>   // For uint64_t
+#include <time.h>    // For clock_gettime()
+
+#include "timingWheel.h"
+
+using namespace std;
+
+#define HEARTBEAT_TICK_MS 1000          // wheel resolution
+#define HEARTBEAT_WHEEL_SLOTS 1024      // ticks per turn of the wheel, a power of two
+#define HEARTBEAT_DEFAULT_INTERVAL 0    // seconds of silence before a PING; 0: never
+#define HEARTBEAT_DEFAULT_TIMEOUT 10    // seconds to answer it
+
+// --ping-interval, --ping-timeout and --idle-timeout in ticks; 0 turns one off.
+struct heartbeatLimits
+{
+    uint64_t interval = HEARTBEAT_DEFAULT_INTERVAL * 1000 / HEARTBEAT_TICK_MS;
+    uint64_t timeout = HEARTBEAT_DEFAULT_TIMEOUT * 1000 / HEARTBEAT_TICK_MS;
+    uint64_t idle = 0;
+
+    bool enabled() const
+    {
+        return interval > 0 || idle > 0;
+    }
+};
+
+enum heartbeatAction
+{
+    HEARTBEAT_WAIT, // alive; check again later
+    HEARTBEAT_PING, // silent for a while; send a PING
+    HEARTBEAT_DEAD, // did not answer the PING
+    HEARTBEAT_IDLE  // sent no message for --idle-timeout
+};
+
+inline uint64_t heartbeatTick()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / HEARTBEAT_TICK_MS;
+}
+
+// One connection's liveness, in ticks. heard and spoke may be stored by the
+// thread reading the client while another checks them.
+struct heartbeat
+{
+    wheelTimer timer;
+    atomic<uint64_t> heard{0}; // anything received
+    atomic<uint64_t> spoke{0}; // a message other than WIRE_PONG
+    uint64_t pinged = 0;       // when the unanswered PING went out, 0 if none
+
+    void start(uint64_t now)
+    {
+        heard.store(now, memory_order_relaxed);
+        spoke.store(now, memory_order_relaxed);
+        pinged = 0;
+    }
+
+    // Tick at which the timer should first go off.
+    uint64_t firstCheck(const heartbeatLimits &limits, uint64_t now) const
+    {
+        if (limits.interval == 0)
+            return now + limits.idle;
+        return now + ((limits.idle > 0) ? min(limits.interval, limits.idle) : limits.interval);
+    }
+
+    // Decides what the timer going off at `now` means and sets next to when
+    // it should go off again (unused for DEAD and IDLE).
+    heartbeatAction check(const heartbeatLimits &limits, uint64_t now, uint64_t &next)
+    {
+        uint64_t lastHeard = heard.load(memory_order_relaxed);
+        uint64_t lastSpoke = spoke.load(memory_order_relaxed);
+        if (limits.idle > 0 && now >= lastSpoke + limits.idle)
+            return HEARTBEAT_IDLE;
+        if (pinged > 0 && lastHeard >= pinged)
+            pinged = 0; // answered
+        if (pinged > 0 && now >= pinged + limits.timeout)
+            return HEARTBEAT_DEAD;
+
+        heartbeatAction action = HEARTBEAT_WAIT;
+        next = UINT64_MAX;
+        if (limits.interval > 0)
+        {
+            if (pinged == 0 && now >= lastHeard + limits.interval)
+            {
+                pinged = now;
+                action = HEARTBEAT_PING;
+            }
+            next = (pinged > 0) ? pinged + limits.timeout : lastHeard + limits.interval;
+        }
+        if (limits.idle > 0)
+            next = min(next, lastSpoke + limits.idle);
+        return action;
+    }
+};
+
+#endif
@@ -0,0 +1,395 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// Optional append-only journal of chat messages (--journal=DIR), so that room
+// history survives a restart.
+//
+// The journal is a directory of segments, each a log file of records and an
+// index file the writer maps into memory: a record count followed by the
+// byte offset of every record. Message threads only append the encoded
+// record to a buffer under a mutex. One writer thread takes everything that
+// has queued up, writes it with one write() per segment, makes it durable
+// with one fdatasync() and only then publishes the records in the index.
+// Messages that arrive during an fsync go out together with the next one
+// (group commit), so durability costs a few syscalls per batch instead of
+// one per message. Messages are fanned out before they are durable; a crash
+// loses at most the batch being written.
+//
+// At start-up the segments are read back in order through their indexes: a
+// sequential scan that never has to search for record boundaries. Bytes past
+// the last indexed record (a write cut short by a crash) are cut off.
+//
+// If the next segment cannot be opened when one fills up (no descriptors, a
+// full disk), the writer tries again with every later batch. Until it
+// succeeds, active() is false and the batches it cannot write are logged and
+// counted in JOURNAL_RECORDS_LOST.
+
+#include <string>      // For std::string
+#include <string_view> // For std::string_view
+#include <vector>      // For std::vector
+#include <algorithm>   // For std::sort
+#include <cstdint>     // For uint16_t, uint32_t, uint64_t
+#include <cstdio>      // For snprintf()
+#include <cstring>     // For memcpy(), strerror()
+#include <cerrno>      // For errno
+#include <ctime>       // For clock_gettime()
+#include <pthread.h>   // For pthread_create(), pthread_cond_t
+#include <dirent.h>    // For opendir(), readdir()
+#include <fcntl.h>     // For open()
+#include <unistd.h>    // For write(), fdatasync(), ftruncate()
+#include <atomic>      // For std::atomic
+#include <sys/mman.h>  // For mmap(), msync()
+#include <sys/stat.h>  // For mkdir(), fstat()
+
+#include "logger.h"
+#include "metrics.h" // For JOURNAL_RECORDS_LOST
+
+using namespace std;
+
+#ifndef JOURNAL_SEGMENT_BYTES
+#define JOURNAL_SEGMENT_BYTES (64u << 20) // a segment's log is closed past this
+#endif
+#ifndef JOURNAL_SEGMENT_RECORDS
+#define JOURNAL_SEGMENT_RECORDS (1u << 20) // index entries per segment
+#endif
+
+enum journalKind : uint8_t
+{
+    JOURNAL_BROADCAST = 1, // target is the room; sequence is the room's number
+    JOURNAL_PRIVATE = 2    // target is the "@alias ..." recipient list
+};
+
+// Start of every record in a log, followed by the target and the text.
+struct journalHeader
+{
+    uint32_t length;       // whole record, header included
+    uint8_t kind;          // journalKind
+    uint8_t reserved;
+    uint16_t targetLength;
+    uint64_t sequence;
+    uint64_t time; // nanoseconds since the epoch
+};
+
+class messageJournal
+{
+private:
+    string directory;
+    bool enabled = false;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    string pending; // encoded records not yet taken by the writer
+
+    // Current segment; touched only by the writer once it has started.
+    uint64_t segmentFirst = 0; // journal-wide number of its first record
+    int logFd = -1;
+    int indexFd = -1;
+    uint64_t *index = NULL; // index[0]: records, index[1 + i]: offset of record i
+    atomic<bool> segmentOpen{false}; // index != NULL, for other threads
+    uint64_t segmentBytes = 0;
+    vector<uint64_t> unpublished; // offsets written but not yet in the index
+
+    static size_t indexBytes()
+    {
+        return (JOURNAL_SEGMENT_RECORDS + 1) * sizeof(uint64_t);
+    }
+
+    string segmentPath(uint64_t first, const char *extension) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu", (unsigned long long)first);
+        return directory + "/" + name + extension;
+    }
+
+    // First record numbers of the segments on disk, oldest first.
+    vector<uint64_t> listSegments() const
+    {
+        vector<uint64_t> segments;
+        DIR *dir = opendir(directory.c_str());
+        if (dir == NULL)
+            return segments;
+        while (struct dirent *entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            if (name.size() == 24 && name.compare(20, 4, ".log") == 0)
+                segments.push_back(strtoull(name.c_str(), NULL, 10));
+        }
+        closedir(dir);
+        sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Opens (or creates) a segment for appending at byte `end`, dropping
+    // anything after it.
+    bool openSegment(uint64_t first, uint64_t end)
+    {
+        segmentFirst = first;
+        segmentBytes = end;
+        logFd = open(segmentPath(first, ".log").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        indexFd = open(segmentPath(first, ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+        void *mapped = MAP_FAILED;
+        if (logFd >= 0 && indexFd >= 0 && ftruncate(logFd, end) == 0 && ftruncate(indexFd, indexBytes()) == 0)
+            mapped = mmap(NULL, indexBytes(), PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            int error = errno;
+            closeSegment(); // so a retry does not leak what did open
+            errno = error;
+            return false;
+        }
+        index = (uint64_t *)mapped;
+        segmentOpen = true;
+        return true;
+    }
+
+    void closeSegment()
+    {
+        if (index != NULL)
+            munmap(index, indexBytes());
+        if (logFd >= 0)
+            close(logFd);
+        if (indexFd >= 0)
+            close(indexFd);
+        index = NULL;
+        logFd = indexFd = -1;
+        segmentOpen = false;
+    }
+
+    // Counts the records in batch from byte `from` on as lost.
+    static void lose(const string &batch, size_t from)
+    {
+        uint64_t records = 0;
+        for (size_t position = from; position < batch.size(); records++)
+        {
+            journalHeader header;
+            memcpy(&header, batch.data() + position, sizeof(header));
+            position += header.length;
+        }
+        if (records == 0)
+            return;
+        metrics.count(JOURNAL_RECORDS_LOST, records);
+        serverLog.log(LOG_ERROR, "\033[31m", "Journal has no open segment; ", records, " messages not written");
+    }
+
+    // Reads one segment through its index. Returns the number of records and
+    // sets end to the byte after the last one.
+    template <typename F>
+    uint64_t scanSegment(uint64_t first, uint64_t &end, F &visit)
+    {
+        end = 0;
+        uint64_t records = 0;
+        int log = open(segmentPath(first, ".log").c_str(), O_RDONLY);
+        int idx = open(segmentPath(first, ".idx").c_str(), O_RDONLY);
+        struct stat logStat, idxStat;
+        if (log >= 0 && idx >= 0 && fstat(log, &logStat) == 0 && fstat(idx, &idxStat) == 0 &&
+            logStat.st_size > 0 && (size_t)idxStat.st_size >= sizeof(uint64_t))
+        {
+            const char *data = (const char *)mmap(NULL, logStat.st_size, PROT_READ, MAP_PRIVATE, log, 0);
+            const uint64_t *offsets = (const uint64_t *)mmap(NULL, idxStat.st_size, PROT_READ, MAP_PRIVATE, idx, 0);
+            if (data != MAP_FAILED && offsets != MAP_FAILED)
+            {
+                uint64_t count = min<uint64_t>(offsets[0], idxStat.st_size / sizeof(uint64_t) - 1);
+                for (; records < count; records++)
+                {
+                    uint64_t offset = offsets[1 + records];
+                    journalHeader header;
+                    if (offset + sizeof(header) > (uint64_t)logStat.st_size)
+                        break;
+                    memcpy(&header, data + offset, sizeof(header));
+                    if (header.length < sizeof(header) + header.targetLength || offset + header.length > (uint64_t)logStat.st_size)
+                        break;
+                    const char *target = data + offset + sizeof(header);
+                    string_view text(target + header.targetLength, header.length - sizeof(header) - header.targetLength);
+                    visit((journalKind)header.kind, string_view(target, header.targetLength), header.sequence, text);
+                    end = offset + header.length;
+                }
+            }
+            if (data != MAP_FAILED)
+                munmap((void *)data, logStat.st_size);
+            if (offsets != MAP_FAILED)
+                munmap((void *)offsets, idxStat.st_size);
+        }
+        if (log >= 0)
+            close(log);
+        if (idx >= 0)
+            close(idx);
+        return records;
+    }
+
+    static bool writeAll(int fd, const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = write(fd, data, length);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Makes [from, to) of batch durable in the current segment, then lists
+    // its records in the index.
+    void commit(const string &batch, size_t from, size_t to)
+    {
+        if (from == to)
+            return;
+        if (!writeAll(logFd, batch.data() + from, to - from) || fdatasync(logFd) < 0)
+        {
+            serverLog.log(LOG_ERROR, "\033[31m", "Journal write failed: ", strerror(errno));
+            unpublished.clear();
+            // Part of the batch may have reached the log. Cut it off so the
+            // next record lands at segmentBytes, the offset the index will
+            // give it; failing that, count the stray bytes as written.
+            struct stat logStat;
+            if (ftruncate(logFd, segmentBytes) < 0 && fstat(logFd, &logStat) == 0)
+                segmentBytes = logStat.st_size;
+            return;
+        }
+        uint64_t records = index[0];
+        for (uint64_t offset : unpublished)
+            index[1 + records++] = offset;
+        index[0] = records;
+        msync(index, (1 + records) * sizeof(uint64_t), MS_SYNC);
+        segmentBytes += to - from;
+        unpublished.clear();
+    }
+
+    // Writes one batch, moving on to a new segment whenever one fills up.
+    void writeBatch(const string &batch)
+    {
+        size_t runStart = 0;
+        size_t position = 0;
+        while (position < batch.size())
+        {
+            journalHeader header;
+            memcpy(&header, batch.data() + position, sizeof(header));
+            uint64_t offset = segmentBytes + (position - runStart);
+            if (index[0] + unpublished.size() == JOURNAL_SEGMENT_RECORDS ||
+                (offset > 0 && offset + header.length > JOURNAL_SEGMENT_BYTES))
+            {
+                commit(batch, runStart, position);
+                runStart = position;
+                uint64_t next = segmentFirst + index[0];
+                closeSegment();
+                if (!openSegment(next, 0))
+                {
+                    serverLog.log(LOG_ERROR, "\033[31m", "Journal segment could not be opened: ", strerror(errno));
+                    lose(batch, runStart);
+                    return;
+                }
+                offset = 0;
+            }
+            unpublished.push_back(offset);
+            position += header.length;
+        }
+        commit(batch, runStart, position);
+    }
+
+    void drain()
+    {
+        string batch;
+        while (true)
+        {
+            pthread_mutex_lock(&mutex);
+            while (pending.empty())
+                pthread_cond_wait(&wake, &mutex);
+            batch.swap(pending);
+            pthread_mutex_unlock(&mutex);
+            // A segment that failed to open at a roll is retried here.
+            if (index == NULL && !openSegment(segmentFirst, 0))
+                lose(batch, 0);
+            else
+                writeBatch(batch);
+            batch.clear();
+        }
+    }
+
+    static void *writerThread(void *arg)
+    {
+        ((messageJournal *)arg)->drain();
+        return NULL;
+    }
+
+public:
+    // Opens the journal in dir, creating it if needed, hands every record
+    // already in it to visit(journalKind, string_view target, uint64_t
+    // sequence, string_view text) and starts the writer. Returns false if the
+    // directory or its last segment cannot be opened.
+    template <typename F>
+    bool start(const string &dir, F visit)
+    {
+        directory = dir;
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+            return false;
+        vector<uint64_t> segments = listSegments();
+        uint64_t first = 0, end = 0, records = 0;
+        for (uint64_t segment : segments)
+        {
+            first = segment;
+            records = scanSegment(segment, end, visit);
+        }
+        if (!openSegment(first, end))
+            return false;
+        index[0] = records; // forget records past a torn write
+        pthread_t writer;
+        pthread_create(&writer, NULL, writerThread, this);
+        pthread_detach(writer);
+        enabled = true;
+        return true;
+    }
+
+    // Queues a message for the writer; returns at once.
+    void append(journalKind kind, string_view target, uint64_t sequence, string_view text)
+    {
+        if (!enabled)
+            return;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        journalHeader header;
+        header.targetLength = min<size_t>(target.size(), UINT16_MAX);
+        header.length = sizeof(header) + header.targetLength + text.size();
+        header.kind = kind;
+        header.reserved = 0;
+        header.sequence = sequence;
+        header.time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+        pthread_mutex_lock(&mutex);
+        pending.append((const char *)&header, sizeof(header));
+        pending.append(target.data(), header.targetLength);
+        pending.append(text.data(), text.size());
+        pthread_mutex_unlock(&mutex);
+        pthread_cond_signal(&wake);
+    }
+
+    // Queues a private message. line is what the client typed and body what
+    // was left once its "@alias" mentions were taken off; the mentions become
+    // the record's target.
+    void appendPrivate(const string &line, const string &body, string_view text)
+    {
+        string_view mentions = string_view(line).substr(0, line.size() - min(body.size(), line.size()));
+        while (!mentions.empty() && mentions.back() == ' ')
+            mentions.remove_suffix(1);
+        append(JOURNAL_PRIVATE, mentions, 0, text);
+    }
+
+    // True once start() has succeeded, even while no segment is open:
+    // messages are still queued then, so that they are written if the
+    // segment can be opened again.
+    bool started() const
+    {
+        return enabled;
+    }
+
+    // True while the journal is writing messages.
+    bool active() const
+    {
+        return enabled && segmentOpen;
+    }
+};
+
+inline messageJournal journal;
+
+#endif
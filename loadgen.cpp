@@ -0,0 +1,506 @@
+// Headless load generator for server.cpp and serverSelect.cpp. Opens many
+// simulated clients, takes each through alias -> CONNECT (or JOIN) -> chat ->
+// EXIT, and sends broadcasts and @private messages at a fixed total rate.
+// Every message carries its send time, so each copy a client receives gives
+// one delivery latency sample; both servers and every engine can be compared
+// on the same workload.
+//
+//   g++ -O2 loadgen.cpp -o loadgen -lpthread
+//   ./loadgen <host> <port> [--clients=N] [--rate=N] [--size=N] ...
+
+// Standard C++ Libraries
+#include <iostream>    // For standard I/O operations
+#include <iomanip>     // For std::setprecision
+#include <sstream>     // For std::ostringstream
+#include <vector>      // For std::vector
+#include <string>      // For std::string
+#include <string_view> // For std::string_view
+#include <atomic>      // For std::atomic
+#include <random>      // For std::mt19937
+#include <cstring>     // For memset()
+#include <cstdlib>     // For atoi(), atof(), strtoull()
+
+// POSIX and Networking Libraries
+#include <unistd.h>       // For close(), usleep()
+#include <fcntl.h>        // For fcntl()
+#include <sys/socket.h>   // For socket(), connect(), send()
+#include <sys/epoll.h>    // For epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/resource.h> // For setrlimit()
+#include <netdb.h>        // For getaddrinfo()
+#include <pthread.h>      // For pthreads and pthread_barrier_t
+
+// Splits received bytes into newline-delimited messages
+#include "framer.h"
+// Heartbeat PING and PONG lines
+#include "wireProtocol.h"
+// Log-linear latency histogram
+#include "metrics.h"
+
+using namespace std;
+
+#define RESET "\033[0m"
+#define RED "\033[31m"   // Red color
+#define GREEN "\033[32m" // Green color
+
+#define PAYLOAD_MARKER "LG " // starts every generated message body
+#define MAX_EVENTS 256
+
+struct loadConfig
+{
+    string host;
+    string port;
+    int clients = 100;
+    int threads = 1;
+    int rooms = 1;           // clients are spread round robin; 1 means CONNECT
+    double rate = 1;         // messages per second per client
+    int size = 64;           // bytes per message body, at least the header
+    double privateShare = 0; // fraction of messages sent as @private
+    double duration = 10;    // seconds of sending
+    double drain = 1;        // seconds to keep reading after the last send
+    double setupTimeout = 30;
+    string prefix = "lg"; // aliases are prefix + client number
+
+    bool parse(int argc, char *argv[])
+    {
+        host = argv[1];
+        port = argv[2];
+        for (int i = 3; i < argc; i++)
+        {
+            string arg = argv[i];
+            size_t eq = arg.find('=');
+            string key = arg.substr(0, eq);
+            string value = (eq == string::npos) ? "" : arg.substr(eq + 1);
+
+            if (key == "--clients" && atoi(value.c_str()) > 1)
+                clients = atoi(value.c_str());
+            else if (key == "--threads" && atoi(value.c_str()) > 0)
+                threads = atoi(value.c_str());
+            else if (key == "--rooms" && atoi(value.c_str()) > 0)
+                rooms = atoi(value.c_str());
+            else if (key == "--rate" && atof(value.c_str()) > 0)
+                rate = atof(value.c_str());
+            else if (key == "--size" && atoi(value.c_str()) > 0)
+                size = atoi(value.c_str());
+            else if (key == "--private" && atof(value.c_str()) >= 0 && atof(value.c_str()) <= 1)
+                privateShare = atof(value.c_str());
+            else if (key == "--duration" && atof(value.c_str()) > 0)
+                duration = atof(value.c_str());
+            else if (key == "--drain" && atof(value.c_str()) >= 0)
+                drain = atof(value.c_str());
+            else if (key == "--setup-timeout" && atof(value.c_str()) > 0)
+                setupTimeout = atof(value.c_str());
+            else if (key == "--prefix" && !value.empty())
+                prefix = value;
+            else
+            {
+                cout << "Unknown option: " << arg << endl;
+                usage(argv[0]);
+                return false;
+            }
+        }
+        if (threads > clients)
+            threads = clients;
+        return true;
+    }
+
+    void usage(const char *program)
+    {
+        cout << "usage: " << program << " <host> <port> [options]" << endl;
+        cout << "  --clients=N        simulated clients (default 100)" << endl;
+        cout << "  --threads=N        load generator threads (default 1)" << endl;
+        cout << "  --rooms=N          rooms to spread clients over (default 1, the CONNECT room)" << endl;
+        cout << "  --rate=N           messages per second per client (default 1)" << endl;
+        cout << "  --size=N           message body bytes (default 64)" << endl;
+        cout << "  --private=F        fraction sent as @private to a room mate (default 0)" << endl;
+        cout << "  --duration=S       seconds of sending (default 10)" << endl;
+        cout << "  --drain=S          seconds to wait for late deliveries (default 1)" << endl;
+        cout << "  --setup-timeout=S  give up on clients not in their room by then (default 30)" << endl;
+        cout << "  --prefix=P         alias prefix (default lg)" << endl;
+    }
+} config;
+
+enum simState
+{
+    AWAITING_ALIAS, // alias sent, waiting for "Alias Assigned"
+    AWAITING_JOIN,  // CONNECT/JOIN sent, waiting to see ourselves join
+    READY,
+    FAILED
+};
+
+struct simClient
+{
+    int sock = -1;
+    int index = 0;
+    int room = 0;
+    string alias;
+    simState state = AWAITING_ALIAS;
+    framer input;
+    string pending; // bytes the socket has not taken yet
+};
+
+// What one thread measured.
+struct loadResult
+{
+    uint64_t sent = 0;
+    uint64_t sentPrivate = 0;
+    uint64_t expected = 0; // deliveries the sends should cause
+    uint64_t delivered = 0;
+    uint64_t failed = 0; // clients that never made it into their room
+    double setupSeconds = 0;
+    histogramSnapshot latency;
+};
+
+struct loadThread
+{
+    pthread_t thread;
+    int first = 0; // clients [first, last)
+    int last = 0;
+    loadResult result;
+};
+
+struct addrinfo *serverAddress = NULL;
+pthread_barrier_t setupDone;
+vector<char> clientReady;   // written before setupDone, read after
+vector<int> roomPopulation; // ready clients per room, counted once everyone is set up
+
+string aliasOf(int index)
+{
+    return config.prefix + to_string(index);
+}
+
+double seconds(uint64_t nanos)
+{
+    return nanos / 1e9;
+}
+
+bool connectClient(simClient &client)
+{
+    client.sock = socket(serverAddress->ai_family, SOCK_STREAM, 0);
+    if (client.sock < 0)
+        return false;
+    // Blocking connect keeps setup simple; every later call is non-blocking.
+    if (connect(client.sock, serverAddress->ai_addr, serverAddress->ai_addrlen) < 0)
+    {
+        close(client.sock);
+        client.sock = -1;
+        return false;
+    }
+    fcntl(client.sock, F_SETFL, fcntl(client.sock, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+void flushPending(simClient &client)
+{
+    while (!client.pending.empty())
+    {
+        ssize_t n = send(client.sock, client.pending.data(), client.pending.size(), MSG_NOSIGNAL);
+        if (n <= 0)
+            return; // EAGAIN: EPOLLOUT resumes it; errors show up as EOF on read
+        client.pending.erase(0, n);
+    }
+}
+
+void sendLine(simClient &client, const string &line)
+{
+    client.pending += line;
+    client.pending += '\n';
+    flushPending(client);
+}
+
+string joinCommand(const simClient &client)
+{
+    if (config.rooms == 1)
+        return "CONNECT";
+    return "JOIN room" + to_string(client.room);
+}
+
+// One line from the server to a simulated client.
+void handleLine(simClient &client, string_view line, loadResult &result)
+{
+    if (line == WIRE_PING)
+        sendLine(client, WIRE_PONG);
+    else if (client.state == AWAITING_ALIAS)
+    {
+        if (line.find("Alias Assigned") != string_view::npos)
+        {
+            client.state = AWAITING_JOIN;
+            sendLine(client, joinCommand(client));
+        }
+        else if (line.find("Alias already taken") != string_view::npos)
+            client.state = FAILED;
+    }
+    else if (client.state == AWAITING_JOIN)
+    {
+        // A join in a busy room may be announced in a batch ("joined: a, b, ...")
+        // that need not name this client; any batch sent after it joined will do.
+        if (line == client.alias + " has joined the ChatRoom" || line.substr(0, 15) == "You have joined" || line.substr(0, 8) == "joined: ")
+            client.state = READY;
+    }
+    else
+    {
+        size_t marker = line.find(PAYLOAD_MARKER);
+        if (marker == string_view::npos)
+            return;
+        uint64_t sentAt = strtoull(line.data() + marker + strlen(PAYLOAD_MARKER), NULL, 10);
+        uint64_t now = nowNanos();
+        if (sentAt > 0 && sentAt <= now)
+        {
+            result.latency.record(now - sentAt);
+            result.delivered++;
+        }
+    }
+}
+
+// Reads until the socket is empty (the sockets are edge triggered).
+void readClient(simClient &client, loadResult &result)
+{
+    while (true)
+    {
+        ssize_t bytesRead = client.input.fill(client.sock, MSG_DONTWAIT);
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead <= 0)
+        {
+            if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                if (client.state != READY)
+                    client.state = FAILED;
+            }
+            break;
+        }
+        string_view line;
+        while (client.input.next(line))
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            handleLine(client, line, result);
+        }
+    }
+}
+
+void pollClients(int epollfd, vector<simClient> &clients, int first, int timeoutMs, loadResult &result)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(epollfd, events, MAX_EVENTS, timeoutMs);
+    for (int n = 0; n < ready; n++)
+    {
+        simClient &client = clients[events[n].data.u32 - first];
+        if (events[n].events & EPOLLOUT)
+            flushPending(client);
+        if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+            readClient(client, result);
+    }
+}
+
+// A message body of config.size bytes: marker, send time, padding.
+string makePayload()
+{
+    string payload = PAYLOAD_MARKER + to_string(nowNanos()) + " ";
+    if ((int)payload.size() < config.size)
+        payload.append(config.size - payload.size(), 'x');
+    return payload;
+}
+
+// A ready client in the same room, or -1 if the sender is alone.
+int pickPeer(const simClient &sender, mt19937 &random)
+{
+    int peers = (config.clients - 1 - sender.room) / config.rooms + 1; // indices room, room + rooms, ...
+    for (int attempt = 0; attempt < 8 && peers > 1; attempt++)
+    {
+        int index = sender.room + (int)(random() % peers) * config.rooms;
+        if (index != sender.index && clientReady[index])
+            return index;
+    }
+    return -1;
+}
+
+void *runThread(void *arg)
+{
+    loadThread *self = (loadThread *)arg;
+    loadResult &result = self->result;
+    int first = self->first;
+    vector<simClient> clients(self->last - self->first);
+    int epollfd = epoll_create1(0);
+    mt19937 random(first + 1);
+
+    // Setup: connect, claim an alias, enter the room.
+    uint64_t setupStart = nowNanos();
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        simClient &client = clients[i];
+        client.index = first + i;
+        client.room = client.index % config.rooms;
+        client.alias = aliasOf(client.index);
+        if (!connectClient(client))
+        {
+            client.state = FAILED;
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = client.index;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, client.sock, &ev);
+        sendLine(client, client.alias);
+        pollClients(epollfd, clients, first, 0, result);
+    }
+    uint64_t deadline = setupStart + config.setupTimeout * 1e9;
+    while (nowNanos() < deadline)
+    {
+        bool settled = true;
+        for (simClient &client : clients)
+            settled = settled && (client.state == READY || client.state == FAILED);
+        if (settled)
+            break;
+        pollClients(epollfd, clients, first, 10, result);
+    }
+    for (simClient &client : clients)
+    {
+        clientReady[client.index] = (client.state == READY);
+        if (client.state != READY)
+            result.failed++;
+    }
+    result.setupSeconds = seconds(nowNanos() - setupStart);
+
+    pthread_barrier_wait(&setupDone);
+    if (first == 0)
+    {
+        for (int i = 0; i < config.clients; i++)
+            if (clientReady[i])
+                roomPopulation[i % config.rooms]++;
+    }
+    pthread_barrier_wait(&setupDone);
+
+    // Sending: the thread's clients share its rate and take turns.
+    vector<int> senders;
+    for (size_t i = 0; i < clients.size(); i++)
+        if (clients[i].state == READY)
+            senders.push_back(i);
+    double threadRate = config.rate * senders.size();
+    uint64_t start = nowNanos();
+    uint64_t stop = start + config.duration * 1e9;
+    size_t turn = 0;
+    uniform_real_distribution<double> coin(0, 1);
+    while (!senders.empty())
+    {
+        uint64_t now = nowNanos();
+        if (now >= stop)
+            break;
+        uint64_t due = seconds(now - start) * threadRate;
+        for (int burst = 0; result.sent < due && burst < 1000; burst++)
+        {
+            simClient &sender = clients[senders[turn++ % senders.size()]];
+            int peer = (coin(random) < config.privateShare) ? pickPeer(sender, random) : -1;
+            if (peer >= 0)
+            {
+                sendLine(sender, "@" + aliasOf(peer) + " " + makePayload());
+                result.sentPrivate++;
+                result.expected++;
+            }
+            else
+            {
+                sendLine(sender, makePayload());
+                result.expected += roomPopulation[sender.room] - 1;
+            }
+            result.sent++;
+        }
+        pollClients(epollfd, clients, first, 1, result);
+    }
+
+    // Drain late deliveries, then leave.
+    uint64_t drainUntil = nowNanos() + config.drain * 1e9;
+    while (nowNanos() < drainUntil)
+        pollClients(epollfd, clients, first, 10, result);
+    for (simClient &client : clients)
+    {
+        if (client.sock < 0)
+            continue;
+        if (client.state == READY)
+            sendLine(client, "EXIT");
+        close(client.sock);
+    }
+    close(epollfd);
+    return NULL;
+}
+
+// Lets one process hold thousands of sockets.
+void raiseDescriptorLimit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+string formatLatency(uint64_t nanos)
+{
+    ostringstream text;
+    text << fixed << setprecision(1);
+    if (nanos < 10000000)
+        text << nanos / 1000.0 << "us";
+    else
+        text << nanos / 1000000.0 << "ms";
+    return text.str();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        cout << RED << "Host and port are required" << RESET << endl;
+        config.usage(argv[0]);
+        return 1;
+    }
+    if (!config.parse(argc, argv))
+        return 1;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host.c_str(), config.port.c_str(), &hints, &serverAddress) != 0)
+    {
+        cout << RED << "Unknown host " << config.host << RESET << endl;
+        return 1;
+    }
+    raiseDescriptorLimit();
+
+    clientReady.assign(config.clients, 0);
+    roomPopulation.assign(config.rooms, 0);
+    pthread_barrier_init(&setupDone, NULL, config.threads);
+    vector<loadThread> threads(config.threads);
+    for (int t = 0; t < config.threads; t++)
+    {
+        threads[t].first = (long)config.clients * t / config.threads;
+        threads[t].last = (long)config.clients * (t + 1) / config.threads;
+        pthread_create(&threads[t].thread, NULL, runThread, &threads[t]);
+    }
+
+    loadResult total;
+    for (loadThread &t : threads)
+    {
+        pthread_join(t.thread, NULL);
+        total.sent += t.result.sent;
+        total.sentPrivate += t.result.sentPrivate;
+        total.expected += t.result.expected;
+        total.delivered += t.result.delivered;
+        total.failed += t.result.failed;
+        total.setupSeconds = max(total.setupSeconds, t.result.setupSeconds);
+        total.latency.merge(t.result.latency);
+    }
+    freeaddrinfo(serverAddress);
+
+    uint64_t joined = config.clients - total.failed;
+    double delivered = total.expected ? 100.0 * total.delivered / total.expected : 0;
+    cout << fixed << setprecision(1);
+    cout << (total.failed ? RED : GREEN) << "clients    " << joined << " of " << config.clients << " in "
+         << config.rooms << " room(s) after " << setprecision(2) << total.setupSeconds << "s" << RESET << endl;
+    cout << setprecision(1);
+    cout << "sent       " << total.sent << " messages (" << total.sent / config.duration << "/s), "
+         << total.sentPrivate << " private, " << config.size << " bytes each" << endl;
+    cout << "delivered  " << total.delivered << " of " << total.expected << " (" << delivered << "%), "
+         << total.delivered / config.duration << "/s" << endl;
+    cout << "latency    p50 " << formatLatency(total.latency.percentile(0.5)) << "  p99 " << formatLatency(total.latency.percentile(0.99))
+         << "  p999 " << formatLatency(total.latency.percentile(0.999)) << "  max " << formatLatency(total.latency.max) << endl;
+    return total.failed ? 2 : 0;
+}
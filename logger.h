@@ -0,0 +1,299 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// Asynchronous logger for the servers' per-message and per-connection lines.
+//
+// A thread that logs copies its arguments, unformatted, into a fixed-size
+// record in its own single-producer ring; no lock, no allocation and no
+// system call. One background thread drains every ring, does the formatting
+// (numbers to text, colour, newline) and hands the result to the terminal in
+// a single write() per batch, sleeping on a condition variable while every
+// ring is empty. When a ring is full the record is dropped and
+// counted, so a slow terminal never slows down the chat; the writer reports
+// how many lines were lost. Records below the configured level are discarded
+// before anything is copied.
+//
+// Arguments may be strings, string_views, C strings, chars and integers.
+// Strings longer than a record are cut short.
+
+#include <string>      // For std::string
+#include <string_view> // For std::string_view
+#include <atomic>      // For std::atomic
+#include <cstdint>     // For uint16_t, int64_t
+#include <cstring>     // For memcpy()
+#include <type_traits> // For std::is_integral, std::is_signed
+#include <pthread.h>   // For pthread_create(), pthread_cond_t
+#include <unistd.h>    // For write(), usleep()
+
+#include "spscQueue.h"
+
+using namespace std;
+
+enum logLevel
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+};
+
+#define LOG_RECORD_BYTES 240 // encoded arguments per line
+#define LOG_RING_RECORDS 4096 // lines a thread may have waiting
+#define LOG_BATCH_BYTES 65536 // flush the writer's buffer past this
+#define LOG_FINISH_MILLIS 1000 // longest finish() waits for the writer
+
+class asyncLogger
+{
+private:
+    // Argument tags inside a record.
+    enum argTag : char
+    {
+        ARG_TEXT,     // uint16_t length, then the bytes
+        ARG_SIGNED,   // int64_t
+        ARG_UNSIGNED, // uint64_t
+        ARG_CHAR      // one byte
+    };
+
+    struct logRecord
+    {
+        const char *color; // a string literal, so the pointer stays valid
+        uint16_t used;     // bytes of args filled in
+        char args[LOG_RECORD_BYTES];
+    };
+
+    struct logRing
+    {
+        spscQueue<logRecord> records{LOG_RING_RECORDS};
+        atomic<uint64_t> dropped{0};
+        uint64_t reported = 0; // touched only by the writer
+        logRing *next = NULL;
+    };
+
+    atomic<int> level{LOG_OFF}; // nothing is recorded until start()
+    atomic<logRing *> rings{NULL};
+    pthread_t writer;
+    // The writer sets sleeping before its last look at the rings, and a
+    // producer checks it after pushing, so one of them always sees the other.
+    atomic<bool> sleeping{false};
+    pthread_mutex_t idleMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+    logRing *myRing()
+    {
+        static thread_local logRing *ring = NULL;
+        if (ring == NULL)
+        {
+            ring = new logRing();
+            logRing *head = rings.load();
+            do
+                ring->next = head;
+            while (!rings.compare_exchange_weak(head, ring));
+        }
+        return ring;
+    }
+
+    static void put(logRecord &record, string_view text)
+    {
+        size_t room = LOG_RECORD_BYTES - record.used;
+        if (room < 1 + sizeof(uint16_t))
+            return;
+        uint16_t length = min(text.size(), room - 1 - sizeof(uint16_t));
+        record.args[record.used++] = ARG_TEXT;
+        memcpy(record.args + record.used, &length, sizeof(length));
+        record.used += sizeof(length);
+        memcpy(record.args + record.used, text.data(), length);
+        record.used += length;
+    }
+
+    static void put(logRecord &record, const char *text)
+    {
+        put(record, string_view(text));
+    }
+
+    static void put(logRecord &record, char c)
+    {
+        if (record.used + 2 > LOG_RECORD_BYTES)
+            return;
+        record.args[record.used++] = ARG_CHAR;
+        record.args[record.used++] = c;
+    }
+
+    template <typename T>
+    static typename enable_if<is_integral<T>::value>::type put(logRecord &record, T value)
+    {
+        if (record.used + 1 + sizeof(uint64_t) > LOG_RECORD_BYTES)
+            return;
+        record.args[record.used++] = is_signed<T>::value ? ARG_SIGNED : ARG_UNSIGNED;
+        if (is_signed<T>::value)
+        {
+            int64_t wide = value;
+            memcpy(record.args + record.used, &wide, sizeof(wide));
+        }
+        else
+        {
+            uint64_t wide = value;
+            memcpy(record.args + record.used, &wide, sizeof(wide));
+        }
+        record.used += sizeof(uint64_t);
+    }
+
+    // Writer side: turns one record back into a line.
+    static void format(const logRecord &record, string &out)
+    {
+        size_t start = out.size();
+        out += record.color;
+        size_t i = 0;
+        while (i < record.used)
+        {
+            char tag = record.args[i++];
+            if (tag == ARG_TEXT)
+            {
+                uint16_t length;
+                memcpy(&length, record.args + i, sizeof(length));
+                i += sizeof(length);
+                out.append(record.args + i, length);
+                i += length;
+            }
+            else if (tag == ARG_CHAR)
+                out += record.args[i++];
+            else
+            {
+                uint64_t raw;
+                memcpy(&raw, record.args + i, sizeof(raw));
+                i += sizeof(raw);
+                out += (tag == ARG_SIGNED) ? to_string((int64_t)raw) : to_string(raw);
+            }
+        }
+        // Chat text already carries its newline.
+        if (out.size() > start && out.back() == '\n')
+            out.pop_back();
+        out += (record.color[0] != '\0') ? "\033[0m\n" : "\n";
+    }
+
+    static void flush(string &out)
+    {
+        size_t sent = 0;
+        while (sent < out.size())
+        {
+            ssize_t n = write(STDOUT_FILENO, out.data() + sent, out.size() - sent);
+            if (n <= 0)
+                break; // nowhere to log to; lose the batch rather than block
+            sent += n;
+        }
+        out.clear();
+    }
+
+    bool allEmpty() const
+    {
+        for (logRing *ring = rings.load(); ring != NULL; ring = ring->next)
+            if (!ring->records.empty())
+                return false;
+        return true;
+    }
+
+    void waitForRecords()
+    {
+        pthread_mutex_lock(&idleMutex);
+        sleeping.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (allEmpty())
+            pthread_cond_wait(&wake, &idleMutex);
+        sleeping.store(false, memory_order_relaxed);
+        pthread_mutex_unlock(&idleMutex);
+    }
+
+    void drain()
+    {
+        string out;
+        logRecord record;
+        while (true)
+        {
+            bool idle = true;
+            for (logRing *ring = rings.load(); ring != NULL; ring = ring->next)
+            {
+                while (ring->records.pop(record))
+                {
+                    idle = false;
+                    format(record, out);
+                    if (out.size() >= LOG_BATCH_BYTES)
+                        flush(out);
+                }
+                uint64_t dropped = ring->dropped.load(memory_order_relaxed);
+                if (dropped != ring->reported)
+                {
+                    out += "\033[33mLogger dropped " + to_string(dropped - ring->reported) + " lines\033[0m\n";
+                    ring->reported = dropped;
+                }
+            }
+            flush(out);
+            if (idle)
+                waitForRecords();
+        }
+    }
+
+    static void *writerThread(void *arg)
+    {
+        ((asyncLogger *)arg)->drain();
+        return NULL;
+    }
+
+public:
+    // Starts the writer; records below minimum are ignored from now on.
+    void start(logLevel minimum)
+    {
+        if (minimum != LOG_OFF)
+        {
+            pthread_create(&writer, NULL, writerThread, this);
+            pthread_detach(writer);
+        }
+        level.store(minimum);
+    }
+
+    // Gives the writer up to LOG_FINISH_MILLIS to print what is queued, for
+    // use on the way out so the last lines before an exit are not lost.
+    void finish()
+    {
+        if (level.load() == LOG_OFF)
+            return;
+        for (int waited = 0; waited < LOG_FINISH_MILLIS; waited++)
+        {
+            if (sleeping.load() && allEmpty())
+                return;
+            usleep(1000);
+        }
+    }
+
+    bool enabled(logLevel severity) const
+    {
+        return severity >= level.load(memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    void log(logLevel severity, const char *color, const Args &...args)
+    {
+        if (!enabled(severity))
+            return;
+        logRecord record;
+        record.color = color;
+        record.used = 0;
+        (put(record, args), ...);
+        logRing *ring = myRing();
+        if (!ring->records.push(record))
+        {
+            ring->dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping.load(memory_order_relaxed))
+        {
+            pthread_mutex_lock(&idleMutex);
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&idleMutex);
+        }
+    }
+};
+
+inline asyncLogger serverLog;
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef MESSAGE_BUFFER_H
+#define MESSAGE_BUFFER_H
+
+// An outgoing message that has been formatted and framed once and is then
+// only read. Every recipient's output queue holds a reference to the same
+// buffer, so fanning a message out to N clients costs one allocation and N
+// reference-count increments instead of N copies. The count is atomic, so a
+// buffer may be shared by several threads (event loops or workers).
+
+#include <memory> // For std::shared_ptr
+#include <string> // For std::string
+
+using namespace std;
+
+typedef shared_ptr<const string> messageBuffer;
+
+// Takes ownership of an already framed message (including its '\n').
+inline messageBuffer makeMessage(string framed)
+{
+    return make_shared<const string>(move(framed));
+}
+
+#endif
@@ -0,0 +1,410 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Counters and latency histograms for the servers.
+//
+// Every thread that records something gets its own block of counters and
+// histograms, and only that thread ever writes it: an update is a relaxed
+// load and store on memory no other writer touches, so the message path takes
+// no lock and no atomic read-modify-write. Readers (the STATS command and the
+// Prometheus exporter) walk the list of blocks and add them up; they may see a
+// line half-counted but never block a writer.
+//
+// Histograms are log-linear: eight buckets per power of two, so any recorded
+// value is known to within 12.5% however wide the range. Latencies are kept in
+// nanoseconds and follow one read batch through the server:
+//
+//   receive -> parse     bytes read until a line's command is known
+//   parse -> fan-out     until the message is queued for every recipient
+//   fan-out -> flush     until the queues have been handed to the kernel
+//   receive -> flush     the whole trip, once per batch
+//
+// Output queue depth is sampled (in messages) each time a queue is flushed.
+
+#include <string>    // For std::string
+#include <algorithm> // For std::min, std::max
+#include <cstdio>    // For snprintf(), fopen(), rename()
+#include <cstdint>   // For uint64_t
+#include <atomic>    // For std::atomic
+#include <time.h>    // For clock_gettime()
+#include <pthread.h> // For pthread_create()
+#include <unistd.h>  // For sleep()
+
+using namespace std;
+
+#define METRICS_DEFAULT_INTERVAL 10 // seconds between Prometheus file rewrites
+#define HISTOGRAM_SUB_BUCKETS 8     // buckets per power of two
+#define HISTOGRAM_BUCKETS 496       // covers all of uint64_t
+
+enum counterId
+{
+    MESSAGES_RECEIVED,
+    BYTES_RECEIVED,
+    MESSAGES_QUEUED, // deliveries: one per recipient
+    BYTES_SENT,
+    MESSAGES_DROPPED, // lost to an output queue's overflow policy
+    CONNECTIONS_OPENED,
+    CONNECTIONS_CLOSED,
+    CLIENTS_DEFERRED, // times a client was over --rate or --room-rate
+    JOURNAL_RECORDS_LOST, // messages the journal had no open segment for
+    COUNTER_COUNT
+};
+
+enum histogramId
+{
+    RECEIVE_TO_PARSE,
+    PARSE_TO_FANOUT,
+    FANOUT_TO_FLUSH,
+    RECEIVE_TO_FLUSH,
+    QUEUE_DEPTH,
+    HISTOGRAM_COUNT
+};
+
+inline uint64_t nowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Sum of every thread's histogram at one moment. Also usable on its own as a
+// plain single-threaded histogram (loadgen.cpp).
+struct histogramSnapshot
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < HISTOGRAM_SUB_BUCKETS)
+            return value;
+        int exponent = 63 - __builtin_clzll(value);
+        return (exponent - 2) * HISTOGRAM_SUB_BUCKETS + ((value >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    }
+
+    // Largest value that lands in bucket i.
+    static uint64_t bucketLimit(size_t i)
+    {
+        if (i < HISTOGRAM_SUB_BUCKETS)
+            return i;
+        int exponent = i / HISTOGRAM_SUB_BUCKETS + 2;
+        uint64_t top = i % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+        return ((top + 1) << (exponent - 3)) - 1;
+    }
+
+    void record(uint64_t value)
+    {
+        buckets[bucketOf(value)]++;
+        count++;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    void merge(const histogramSnapshot &other)
+    {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+            buckets[i] += other.buckets[i];
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double fraction) const
+    {
+        if (count == 0)
+            return 0;
+        uint64_t wanted = fraction * count;
+        if (wanted == 0)
+            wanted = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            seen += buckets[i];
+            if (seen >= wanted)
+                return min(bucketLimit(i), max);
+        }
+        return max;
+    }
+
+    // Values recorded that were below limit.
+    uint64_t countBelow(uint64_t limit) const
+    {
+        uint64_t below = 0;
+        for (size_t i = 0; i < bucketOf(limit); i++)
+            below += buckets[i];
+        return below;
+    }
+};
+
+struct metricsSnapshot
+{
+    uint64_t counters[COUNTER_COUNT] = {};
+    histogramSnapshot histograms[HISTOGRAM_COUNT];
+    double uptime = 0; // seconds
+};
+
+class serverMetrics
+{
+private:
+    struct histogram
+    {
+        atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> sum{0};
+        atomic<uint64_t> max{0};
+    };
+
+    struct threadStats
+    {
+        atomic<uint64_t> counters[COUNTER_COUNT] = {};
+        histogram histograms[HISTOGRAM_COUNT];
+        // The batch being timed; touched only by the owning thread.
+        bool batchOpen = false;
+        bool fannedOut = false;
+        uint64_t batchStart = 0;
+        uint64_t lastMark = 0;
+        threadStats *next = NULL;
+    };
+
+    atomic<threadStats *> threads{NULL};
+    uint64_t startedAt = nowNanos();
+    string exportPath;
+    int exportInterval = METRICS_DEFAULT_INTERVAL;
+
+    threadStats *mine()
+    {
+        static thread_local threadStats *stats = NULL;
+        if (stats == NULL)
+        {
+            stats = new threadStats();
+            threadStats *head = threads.load();
+            do
+                stats->next = head;
+            while (!threads.compare_exchange_weak(head, stats));
+        }
+        return stats;
+    }
+
+    // Only the owning thread writes, so there is no need for fetch_add.
+    static void bump(atomic<uint64_t> &value, uint64_t by)
+    {
+        value.store(value.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+    static void exportLoop(serverMetrics *self)
+    {
+        while (true)
+        {
+            sleep(self->exportInterval);
+            string temporary = self->exportPath + ".tmp";
+            FILE *file = fopen(temporary.c_str(), "w");
+            if (file == NULL)
+                continue;
+            string text = self->prometheus();
+            fwrite(text.data(), 1, text.size(), file);
+            fclose(file);
+            rename(temporary.c_str(), self->exportPath.c_str()); // scrapers never see half a file
+        }
+    }
+
+    static void *exportThread(void *arg)
+    {
+        exportLoop((serverMetrics *)arg);
+        return NULL;
+    }
+
+    static string number(double value)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.9g", value);
+        return text;
+    }
+
+    static void promCounter(string &out, const char *name, const char *help, uint64_t value)
+    {
+        out += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+        out += string(name) + " " + to_string(value) + "\n";
+    }
+
+    // Buckets at each power of two from 2^first to 2^last, in the given unit.
+    static void promHistogram(string &out, const char *name, const char *help, const histogramSnapshot &h, int first, int last, double unit)
+    {
+        out += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " histogram\n";
+        for (int k = first; k <= last; k++)
+        {
+            uint64_t limit = 1ull << k;
+            out += string(name) + "_bucket{le=\"" + number((limit - 1) * unit) + "\"} " + to_string(h.countBelow(limit)) + "\n";
+        }
+        out += string(name) + "_bucket{le=\"+Inf\"} " + to_string(h.count) + "\n";
+        out += string(name) + "_sum " + number(h.sum * unit) + "\n";
+        out += string(name) + "_count " + to_string(h.count) + "\n";
+    }
+
+    static string latencyLine(const char *name, const histogramSnapshot &h)
+    {
+        char line[128];
+        snprintf(line, sizeof(line), "  %-16s %8.1f %8.1f %8.1f  (%llu)\n", name, h.percentile(0.5) / 1000.0,
+                 h.percentile(0.99) / 1000.0, h.max / 1000.0, (unsigned long long)h.count);
+        return line;
+    }
+
+public:
+    void count(counterId counter, uint64_t by = 1)
+    {
+        bump(mine()->counters[counter], by);
+    }
+
+    void record(histogramId id, uint64_t value)
+    {
+        histogram &h = mine()->histograms[id];
+        bump(h.buckets[histogramSnapshot::bucketOf(value)], 1);
+        bump(h.count, 1);
+        bump(h.sum, value);
+        if (value > h.max.load(memory_order_relaxed))
+            h.max.store(value, memory_order_relaxed);
+    }
+
+    // Bytes have just been read: starts timing a batch on this thread.
+    void received()
+    {
+        threadStats *stats = mine();
+        stats->lastMark = nowNanos();
+        if (!stats->batchOpen)
+        {
+            stats->batchOpen = true;
+            stats->batchStart = stats->lastMark;
+        }
+    }
+
+    // Records the time since the previous received() or lap() on this thread.
+    void lap(histogramId id)
+    {
+        threadStats *stats = mine();
+        if (!stats->batchOpen)
+            return;
+        uint64_t now = nowNanos();
+        record(id, now - stats->lastMark);
+        stats->lastMark = now;
+        if (id == PARSE_TO_FANOUT)
+            stats->fannedOut = true;
+    }
+
+    // The batch's replies have been flushed; closes the batch.
+    void flushed()
+    {
+        threadStats *stats = mine();
+        if (stats->batchOpen && stats->fannedOut)
+        {
+            uint64_t now = nowNanos();
+            record(FANOUT_TO_FLUSH, now - stats->lastMark);
+            record(RECEIVE_TO_FLUSH, now - stats->batchStart);
+        }
+        stats->batchOpen = false;
+        stats->fannedOut = false;
+    }
+
+    metricsSnapshot snapshot()
+    {
+        metricsSnapshot total;
+        for (threadStats *stats = threads.load(); stats != NULL; stats = stats->next)
+        {
+            for (int c = 0; c < COUNTER_COUNT; c++)
+                total.counters[c] += stats->counters[c].load(memory_order_relaxed);
+            for (int id = 0; id < HISTOGRAM_COUNT; id++)
+            {
+                histogram &from = stats->histograms[id];
+                histogramSnapshot &to = total.histograms[id];
+                for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+                    to.buckets[i] += from.buckets[i].load(memory_order_relaxed);
+                to.count += from.count.load(memory_order_relaxed);
+                to.sum += from.sum.load(memory_order_relaxed);
+                to.max = std::max(to.max, from.max.load(memory_order_relaxed));
+            }
+        }
+        total.uptime = (nowNanos() - startedAt) / 1e9;
+        return total;
+    }
+
+    // Human-readable summary, the reply to STATS.
+    string summary()
+    {
+        metricsSnapshot s = snapshot();
+        const uint64_t *c = s.counters;
+        double seconds = (s.uptime > 0) ? s.uptime : 1;
+        char line[256];
+        string out;
+        snprintf(line, sizeof(line), "Server statistics, up %.0fs\n", s.uptime);
+        out += line;
+        snprintf(line, sizeof(line), "clients: %llu connected, %llu since start\n",
+                 (unsigned long long)(c[CONNECTIONS_OPENED] - c[CONNECTIONS_CLOSED]), (unsigned long long)c[CONNECTIONS_OPENED]);
+        out += line;
+        snprintf(line, sizeof(line), "messages: %llu in (%.1f/s), %llu out (%.1f/s), %llu dropped\n",
+                 (unsigned long long)c[MESSAGES_RECEIVED], c[MESSAGES_RECEIVED] / seconds,
+                 (unsigned long long)c[MESSAGES_QUEUED], c[MESSAGES_QUEUED] / seconds, (unsigned long long)c[MESSAGES_DROPPED]);
+        out += line;
+        snprintf(line, sizeof(line), "bytes: %llu in, %llu out\n", (unsigned long long)c[BYTES_RECEIVED], (unsigned long long)c[BYTES_SENT]);
+        out += line;
+        snprintf(line, sizeof(line), "rate limited: %llu times\n", (unsigned long long)c[CLIENTS_DEFERRED]);
+        out += line;
+        if (c[JOURNAL_RECORDS_LOST] > 0)
+        {
+            snprintf(line, sizeof(line), "journal: %llu messages not written\n", (unsigned long long)c[JOURNAL_RECORDS_LOST]);
+            out += line;
+        }
+        out += "latency in us:         p50      p99      max  (samples)\n";
+        out += latencyLine("receive->parse", s.histograms[RECEIVE_TO_PARSE]);
+        out += latencyLine("parse->fan-out", s.histograms[PARSE_TO_FANOUT]);
+        out += latencyLine("fan-out->flush", s.histograms[FANOUT_TO_FLUSH]);
+        out += latencyLine("receive->flush", s.histograms[RECEIVE_TO_FLUSH]);
+        const histogramSnapshot &depth = s.histograms[QUEUE_DEPTH];
+        snprintf(line, sizeof(line), "output queue depth: p50 %llu, p99 %llu, max %llu messages",
+                 (unsigned long long)depth.percentile(0.5), (unsigned long long)depth.percentile(0.99), (unsigned long long)depth.max);
+        out += line;
+        return out;
+    }
+
+    // Prometheus text exposition format.
+    string prometheus()
+    {
+        metricsSnapshot s = snapshot();
+        const uint64_t *c = s.counters;
+        string out;
+        promCounter(out, "chat_messages_received_total", "Lines received from clients.", c[MESSAGES_RECEIVED]);
+        promCounter(out, "chat_bytes_received_total", "Bytes read from client sockets.", c[BYTES_RECEIVED]);
+        promCounter(out, "chat_messages_queued_total", "Messages queued for delivery, one per recipient.", c[MESSAGES_QUEUED]);
+        promCounter(out, "chat_bytes_sent_total", "Bytes written to client sockets.", c[BYTES_SENT]);
+        promCounter(out, "chat_messages_dropped_total", "Messages dropped by the output queue overflow policy.", c[MESSAGES_DROPPED]);
+        promCounter(out, "chat_connections_opened_total", "Clients admitted.", c[CONNECTIONS_OPENED]);
+        promCounter(out, "chat_clients_deferred_total", "Times a client was over its rate limit and not read for a while.", c[CLIENTS_DEFERRED]);
+        promCounter(out, "chat_journal_records_lost_total", "Messages not journaled because no segment could be opened.", c[JOURNAL_RECORDS_LOST]);
+        out += "# HELP chat_clients Clients currently connected.\n# TYPE chat_clients gauge\n";
+        out += "chat_clients " + to_string(c[CONNECTIONS_OPENED] - c[CONNECTIONS_CLOSED]) + "\n";
+        out += "# HELP chat_uptime_seconds Seconds since the server started.\n# TYPE chat_uptime_seconds gauge\n";
+        out += "chat_uptime_seconds " + number(s.uptime) + "\n";
+        // 1us to about 8.6s
+        promHistogram(out, "chat_receive_to_parse_seconds", "Time from reading a line to knowing its command.", s.histograms[RECEIVE_TO_PARSE], 10, 33, 1e-9);
+        promHistogram(out, "chat_parse_to_fanout_seconds", "Time to queue a message for every recipient.", s.histograms[PARSE_TO_FANOUT], 10, 33, 1e-9);
+        promHistogram(out, "chat_fanout_to_flush_seconds", "Time from the last fan-out to flushing the queues.", s.histograms[FANOUT_TO_FLUSH], 10, 33, 1e-9);
+        promHistogram(out, "chat_receive_to_flush_seconds", "Time from reading a batch to flushing its replies.", s.histograms[RECEIVE_TO_FLUSH], 10, 33, 1e-9);
+        promHistogram(out, "chat_output_queue_depth_messages", "Messages waiting in a client's queue when it is flushed.", s.histograms[QUEUE_DEPTH], 0, 16, 1);
+        return out;
+    }
+
+    // Rewrites path in Prometheus format every interval seconds.
+    void startExporter(const string &path, int interval)
+    {
+        if (path.empty())
+            return;
+        exportPath = path;
+        exportInterval = interval;
+        pthread_t exporter;
+        pthread_create(&exporter, NULL, exportThread, this);
+        pthread_detach(exporter);
+    }
+};
+
+inline serverMetrics metrics;
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+// Per-connection queue of outgoing messages. Nothing here blocks: flush()
+// hands as many queued messages as possible to the kernel in one writev-style
+// sendmsg() per call and keeps the rest until the socket is writable again.
+// Queued messages are shared buffers (messageBuffer.h), never copies.
+//
+// A queue is bounded by outputLimits. When a push would exceed them the
+// overflow policy decides what gives: the oldest unsent messages, new
+// broadcasts, or the connection itself (push() reports PUSH_OVERFLOW and the
+// caller disconnects the client). Either way one stalled reader costs at most
+// the configured memory and never delays delivery to anyone else.
+
+#include <deque>        // For std::deque
+#include <algorithm>    // For std::max
+#include <string>       // For std::string
+#include <cerrno>       // For errno
+#include <cstring>      // For memset()
+#include <sys/socket.h> // For sendmsg()
+#include <sys/uio.h>    // For struct iovec
+
+#include "messageBuffer.h"
+#include "metrics.h" // For BYTES_SENT, MESSAGES_DROPPED
+
+using namespace std;
+
+#define OUTPUT_IOV_MAX 64 // messages gathered into one syscall
+#define OUTPUT_DEFAULT_BYTES (1 << 20) // per-client queue limits
+#define OUTPUT_DEFAULT_MESSAGES 8192
+
+enum overflowPolicy
+{
+    OVERFLOW_DROP_OLDEST,    // evict the oldest unsent messages to make room
+    OVERFLOW_DROP_BROADCAST, // drop broadcasts (new first, then queued); private messages stay
+    OVERFLOW_DISCONNECT      // close the connection with a notice
+};
+
+struct outputLimits
+{
+    size_t maxBytes = OUTPUT_DEFAULT_BYTES;
+    size_t maxMessages = OUTPUT_DEFAULT_MESSAGES;
+    overflowPolicy policy = OVERFLOW_DROP_OLDEST;
+};
+
+enum pushResult
+{
+    PUSH_QUEUED,
+    PUSH_DROPPED, // the new message was dropped by the policy
+    PUSH_OVERFLOW // limit hit and the policy (or a full private backlog) says disconnect
+};
+
+enum flushStatus
+{
+    FLUSH_DONE,    // queue is empty
+    FLUSH_BLOCKED, // socket buffer full; wait for writability
+    FLUSH_FAILED   // peer gone or socket error
+};
+
+class outputQueue
+{
+private:
+    struct entry
+    {
+        messageBuffer message;
+        bool broadcast; // may be dropped under OVERFLOW_DROP_BROADCAST
+    };
+    deque<entry> messages;
+    size_t offset = 0; // bytes of messages.front() already sent
+    size_t queuedBytes = 0;
+    size_t droppedCount = 0;
+    size_t keptFront = 0; // leading messages evictOldest(true) may not take; never rescanned
+
+    bool fits(size_t length, const outputLimits &limits) const
+    {
+        return messages.size() < limits.maxMessages && queuedBytes + length <= limits.maxBytes;
+    }
+
+    // The front message may be partly written; evicting it would corrupt the
+    // stream, so it is never a candidate. Private messages skipped while
+    // looking for a broadcast are remembered in keptFront, so a backlog of
+    // them is walked once rather than on every eviction.
+    bool evictOldest(bool broadcastOnly)
+    {
+        size_t first = (offset > 0) ? 1 : 0;
+        for (size_t i = broadcastOnly ? max(first, keptFront) : first; i < messages.size(); i++)
+        {
+            if (broadcastOnly && !messages[i].broadcast)
+            {
+                keptFront = i + 1;
+                continue;
+            }
+            if (i < keptFront)
+                keptFront--;
+            queuedBytes -= messages[i].message->size();
+            messages.erase(messages.begin() + i);
+            droppedCount++;
+            metrics.count(MESSAGES_DROPPED);
+            return true;
+        }
+        return false;
+    }
+
+public:
+    // Queues a message unless the limits and policy say otherwise. broadcast
+    // marks messages sent to the whole room rather than to this client only.
+    pushResult push(messageBuffer message, bool broadcast, const outputLimits &limits)
+    {
+        size_t length = message->size();
+        size_t pinned = (offset > 0) ? messages.front().message->size() : 0;
+        if (length + pinned > limits.maxBytes || limits.maxMessages <= (offset > 0 ? 1u : 0u))
+        {
+            // Could not fit even behind just the partly sent front message:
+            // drop it alone rather than evict the backlog first or disconnect
+            // a reader that is keeping up.
+            droppedCount++;
+            metrics.count(MESSAGES_DROPPED);
+            return PUSH_DROPPED;
+        }
+        if (!fits(length, limits))
+        {
+            if (limits.policy == OVERFLOW_DISCONNECT)
+                return PUSH_OVERFLOW;
+            if (limits.policy == OVERFLOW_DROP_BROADCAST && broadcast)
+            {
+                droppedCount++;
+                metrics.count(MESSAGES_DROPPED);
+                return PUSH_DROPPED;
+            }
+            bool broadcastOnly = (limits.policy == OVERFLOW_DROP_BROADCAST);
+            while (!fits(length, limits) && evictOldest(broadcastOnly))
+                ;
+            if (!fits(length, limits))
+                return PUSH_OVERFLOW; // backlog is all private messages
+        }
+        queuedBytes += length;
+        messages.push_back({move(message), broadcast});
+        return PUSH_QUEUED;
+    }
+
+    bool empty() const
+    {
+        return messages.empty();
+    }
+
+    size_t bytes() const
+    {
+        return queuedBytes;
+    }
+
+    size_t count() const
+    {
+        return messages.size();
+    }
+
+    // Messages lost to the overflow policy over the queue's lifetime.
+    size_t dropped() const
+    {
+        return droppedCount;
+    }
+
+    // Fills iov with the unsent bytes, oldest first. Returns entries used.
+    int gather(struct iovec *iov, int maxEntries) const
+    {
+        int used = 0;
+        for (auto it = messages.begin(); it != messages.end() && used < maxEntries; ++it, ++used)
+        {
+            size_t skip = (used == 0) ? offset : 0;
+            iov[used].iov_base = (void *)(it->message->data() + skip);
+            iov[used].iov_len = it->message->size() - skip;
+        }
+        return used;
+    }
+
+    // Drops `sent` bytes from the front after a successful send.
+    void consume(size_t sent)
+    {
+        metrics.count(BYTES_SENT, sent);
+        queuedBytes -= sent;
+        while (sent > 0)
+        {
+            size_t left = messages.front().message->size() - offset;
+            if (sent < left)
+            {
+                offset += sent;
+                return;
+            }
+            sent -= left;
+            offset = 0;
+            messages.pop_front();
+            if (keptFront > 0)
+                keptFront--;
+        }
+    }
+
+    flushStatus flush(int sock)
+    {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        while (!messages.empty())
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = gather(iov, OUTPUT_IOV_MAX);
+            // MSG_DONTWAIT keeps this non-blocking even on a blocking socket.
+            ssize_t sent = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return FLUSH_BLOCKED;
+                return FLUSH_FAILED;
+            }
+            consume(sent);
+        }
+        return FLUSH_DONE;
+    }
+
+    void clear()
+    {
+        messages.clear();
+        offset = 0;
+        queuedBytes = 0;
+        keptFront = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,180 @@
+// Microbenchmark for commandParser.h against the substr/+= based parsing the
+// servers used before. Both resolve mentions against the same room and are
+// called the way the servers call them: on a mutable copy of the line that
+// is trimmed to the body. The copy is timed on its own and shown as the
+// baseline.
+//
+//   g++ -O2 parserBench.cpp -o parserBench && ./parserBench [iterations]
+
+// Standard C++ Libraries
+#include <iostream>  // For standard I/O operations
+#include <iomanip>   // For std::setw, std::setprecision
+#include <vector>    // For std::vector
+#include <map>       // For std::map
+#include <string>    // For std::string
+#include <chrono>    // For std::chrono::steady_clock
+#include <cstdlib>   // For malloc(), free(), atol()
+#include <new>       // For std::bad_alloc
+
+#include "commandParser.h"
+
+using namespace std;
+
+#define RESET "\033[0m"
+#define RED "\033[31m"   // Red color
+#define GREEN "\033[32m" // Green color
+
+// Every heap allocation in the process goes through here.
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = malloc(size))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+map<string, int, less<>> room = {{"alice", 4}, {"bob", 5}, {"carol", 6}, {"dave", 7}};
+
+// The previous parser, as it was in both servers.
+void legacyPrivateMsgParser(string &message, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+{
+    int index = 0;
+    while (index < (int)message.size() && message[index] == '@')
+    {
+        string username;
+        index++; // skip the @
+        while (index < (int)message.size() && message[index] != ' ')
+        {
+            username += message[index];
+            index++; // build the username string
+        }
+        if (room.find(username) != room.end())
+            privateSocketNo.push_back(room.find(username)->second);
+        else
+            privateAliasNotFound.push_back(username);
+        index++; // skip the space
+    }
+    if (index < (int)message.size())
+        message = message.substr(index);
+    else
+        message = "";
+}
+
+msgType legacyCommandHandler(string &message, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+{
+    if (!message.empty() && message[0] == '@')
+    {
+        legacyPrivateMsgParser(message, privateSocketNo, privateAliasNotFound);
+        return PRIVATE;
+    }
+    else if (message.size() >= 7 && message.substr(0, 7) == "CONNECT")
+        return CONNECT;
+    else if (message.size() >= 10 && message.substr(0, 10) == "DISCONNECT")
+        return DISCONNECT;
+    else if (message.size() >= 4 && message.substr(0, 4) == "EXIT")
+        return EXIT;
+    return BROADCAST;
+}
+
+// The servers' commandHandler() on top of commandParser.h.
+msgType viewCommandHandler(string &message, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+{
+    msgType command = parseCommand(message).command;
+    if (command != PRIVATE)
+        return command;
+    string_view rest = message;
+    string_view username;
+    while (nextMention(rest, username))
+    {
+        auto it = room.find(username);
+        if (it != room.end())
+            privateSocketNo.push_back(it->second);
+        else
+            privateAliasNotFound.emplace_back(username);
+    }
+    message.erase(0, rest.data() - message.data());
+    return command;
+}
+
+vector<string> samples = {
+    "hi",
+    "hello everyone, how is the weather over there today?",
+    "CONNECT",
+    "DISCONNECT",
+    "EXIT",
+    "@alice hi",
+    "@alice @bob @carol meeting moved to three o'clock, bring the slides",
+    "@dave",
+    "@nobody are you there",
+    "@alice@bob  two spaces",
+    "CONNECTED to what?",
+    "@",
+    "",
+};
+
+template <typename F>
+void run(const char *name, long iterations, F handle)
+{
+    vector<int> privateSocketNo;
+    vector<string> privateAliasNotFound;
+    privateSocketNo.reserve(8);
+    privateAliasNotFound.reserve(8);
+    volatile size_t sink = 0; // keeps the calls from being optimised away
+    size_t before = allocations;
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++)
+    {
+        for (const string &sample : samples)
+        {
+            string message = sample;
+            sink += handle(message, privateSocketNo, privateAliasNotFound) + message.size();
+            privateSocketNo.clear();
+            privateAliasNotFound.clear();
+        }
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    double perMessage = elapsed.count() / (iterations * samples.size());
+    double allocsPerMessage = (double)(allocations - before) / (iterations * samples.size());
+    cout << left << setw(12) << name << right << fixed << setprecision(1)
+         << setw(10) << perMessage << " ns/msg" << setw(10) << setprecision(2)
+         << allocsPerMessage << " allocs/msg" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    // Both parsers must agree before their speed means anything.
+    for (const string &sample : samples)
+    {
+        string a = sample, b = sample;
+        vector<int> socksA, socksB;
+        vector<string> missingA, missingB;
+        msgType commandA = legacyCommandHandler(a, socksA, missingA);
+        msgType commandB = viewCommandHandler(b, socksB, missingB);
+        if (commandA != commandB || a != b || socksA != socksB || missingA != missingB)
+        {
+            cout << RED << "Parsers disagree on \"" << sample << "\"" << RESET << endl;
+            return 1;
+        }
+    }
+    cout << GREEN << "Parsers agree on " << samples.size() << " sample lines" << RESET << endl;
+
+    run("copy only", iterations, [](string &message, vector<int> &, vector<string> &)
+        { return (int)message.size(); });
+    run("legacy", iterations, legacyCommandHandler);
+    run("string_view", iterations, viewCommandHandler);
+    return 0;
+}
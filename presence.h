@@ -0,0 +1,160 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+// Join and leave notices, coalesced per room, and the roster a joiner is
+// shown.
+//
+// Announcing every change to every member costs O(members) messages per
+// change, so a reconnect storm of N clients used to cost O(N^2). A room's
+// presenceBatch lets the first change after a quiet spell go out at once, as
+// before, and collects any that follow within --presence-window into a single
+// notice sent when the window closes:
+//
+//   alice has joined the ChatRoom          one change
+//   joined: bob, carol, dave / left: erin  a batch
+//
+// Binary clients get the batch as back-to-back FRAME_JOIN and FRAME_LEAVE
+// frames in one buffer, the deltas they apply to the roster they were sent
+// on joining. A text notice names at most PRESENCE_MAX_NAMES aliases of each
+// kind; the frames always carry every change.
+//
+// Each batch is numbered. A member whose own join is still pending flushes
+// the batch before its first message goes out, so nobody hears from a
+// member before hearing that it joined.
+//
+// A batch is used by one thread at a time; callers that share one lock it.
+
+#include <string>    // For std::string
+#include <vector>    // For std::vector
+#include <atomic>    // For std::atomic
+#include <algorithm> // For std::nth_element, std::partial_sort, std::max
+#include <cstdint>   // For uint32_t, uint64_t
+
+#include "wireProtocol.h"
+
+using namespace std;
+
+#define PRESENCE_DEFAULT_WINDOW_MS 200 // changes after the first wait this long to go out together
+#define PRESENCE_MAX_NAMES 20          // aliases of each kind spelled out in one text notice
+#define ROSTER_PAGE_SIZE 50            // aliases per roster page
+
+struct presenceChange
+{
+    bool joined;
+    uint32_t id; // sender id for the binary frame
+    string alias;
+};
+
+class presenceBatch
+{
+private:
+    vector<presenceChange> changes;
+    uint64_t quietUntil = 0;    // CLOCK_MONOTONIC ns; a change before this waits
+    atomic<uint64_t> number{1}; // of the batch being collected
+
+    static void listNames(string &text, const char *label, bool joined, const vector<presenceChange> &changes)
+    {
+        size_t count = 0;
+        for (const presenceChange &change : changes)
+        {
+            if (change.joined != joined)
+                continue;
+            if (count < PRESENCE_MAX_NAMES)
+            {
+                text += (count == 0) ? (text.empty() ? "" : " / ") + string(label) : ", ";
+                text += change.alias;
+            }
+            count++;
+        }
+        if (count > PRESENCE_MAX_NAMES)
+            text += " and " + to_string(count - PRESENCE_MAX_NAMES) + " more";
+    }
+
+public:
+    // Records a change at `now`. Returns true if the room has been quiet for
+    // a window, in which case the caller sends take() right away; otherwise
+    // the change waits until due().
+    bool add(bool joined, uint32_t id, const string &alias, uint64_t now)
+    {
+        changes.push_back({joined, id, alias});
+        return changes.size() == 1 && now >= quietUntil;
+    }
+
+    bool pending() const
+    {
+        return !changes.empty();
+    }
+
+    uint64_t due() const
+    {
+        return quietUntil;
+    }
+
+    // Number of the batch a change added now goes out in.
+    uint64_t batch() const
+    {
+        return number.load(memory_order_relaxed);
+    }
+
+    // True once batch `which` has been taken. Safe to call without the lock.
+    bool announced(uint64_t which) const
+    {
+        return which < number.load(memory_order_acquire);
+    }
+
+    // Builds the notice for every pending change, text without a trailing
+    // newline, and starts the next batch and window.
+    void take(string &text, string &frames, uint64_t now, uint64_t window)
+    {
+        text.clear();
+        frames.clear();
+        if (changes.size() == 1)
+            text = changes[0].alias + (changes[0].joined ? " has joined the ChatRoom" : " has left the ChatRoom");
+        else
+        {
+            listNames(text, "joined: ", true, changes);
+            listNames(text, "left: ", false, changes);
+        }
+        for (const presenceChange &change : changes)
+            frames += encodeFrame(change.joined ? FRAME_JOIN : FRAME_LEAVE, change.id, change.alias);
+        changes.clear();
+        quietUntil = now + window;
+        number.fetch_add(1, memory_order_release);
+    }
+};
+
+// One page (from 1) of a room's aliases, sorted, as a single line:
+//
+//   alice bob carol currently in Chat Room
+//   alice ... currently in Chat Room (1-50 of 1200; WHO 2 for more)
+//
+// Only the requested page is sorted, so a joiner of a large room costs one
+// pass over the list rather than a full sort. Reorders aliases. Returns an
+// empty string if the page is past the end.
+inline string rosterPage(vector<string> &aliases, size_t page)
+{
+    page = max<size_t>(page, 1);
+    size_t first = (page - 1) * ROSTER_PAGE_SIZE;
+    if (first >= aliases.size())
+        return "";
+    size_t last = min(first + ROSTER_PAGE_SIZE, aliases.size());
+    if (first > 0)
+        nth_element(aliases.begin(), aliases.begin() + first, aliases.end());
+    partial_sort(aliases.begin() + first, aliases.begin() + last, aliases.end());
+
+    string line;
+    for (size_t i = first; i < last; i++)
+    {
+        line += aliases[i];
+        line += " ";
+    }
+    line += "currently in Chat Room";
+    if (first > 0 || last < aliases.size())
+    {
+        line += " (" + to_string(first + 1) + "-" + to_string(last) + " of " + to_string(aliases.size());
+        line += (last < aliases.size()) ? "; WHO " + to_string(page + 1) + " for more)" : ")";
+    }
+    return line;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+// Token buckets that limit how fast messages are taken from clients (--rate
+// per connection, --room-rate per room).
+//
+// A bucket refills at `rate` tokens a second up to `burst` tokens, and every
+// message takes one. Instead of a token count and a refill time, a bucket
+// keeps one number: the time at which it would be full again. A message may
+// pass once that time is less than (burst - 1) message intervals away, and
+// taking it moves the time one interval further. Checking and charging are a
+// comparison and an addition, with no division and no refill step, so the
+// limiter can run on every message. A room's bucket is shared by every thread
+// that serves a member and is charged with one compare-and-swap.
+//
+// The servers never drop a message for being over the limit: they stop
+// reading the client until wait() has passed, so its unread lines stay in
+// its framer and socket and TCP slows the sender down.
+
+#include <atomic>    // For std::atomic
+#include <algorithm> // For std::max
+#include <cstdint>   // For uint64_t
+#include <time.h>    // For clock_gettime()
+
+using namespace std;
+
+// Rate and burst of a bucket, in nanoseconds; interval 0 means unlimited.
+struct rateLimit
+{
+    uint64_t interval = 0;  // between two messages at the steady rate
+    uint64_t tolerance = 0; // how far ahead a burst may run: (burst - 1) intervals
+
+    rateLimit() {}
+    rateLimit(unsigned perSecond, unsigned burst)
+    {
+        if (perSecond == 0)
+            return;
+        interval = 1000000000ull / perSecond;
+        tolerance = (max(burst, 1u) - 1) * interval;
+    }
+
+    bool enabled() const
+    {
+        return interval > 0;
+    }
+
+    // Nanoseconds from now until a bucket that is full again at `due` can
+    // pass a message; 0 if it can now.
+    uint64_t wait(uint64_t due, uint64_t now) const
+    {
+        return (due > now + tolerance) ? due - now - tolerance : 0;
+    }
+};
+
+// A bucket used by one thread at a time.
+class tokenBucket
+{
+private:
+    uint64_t due = 0;
+
+public:
+    uint64_t wait(const rateLimit &limit, uint64_t now) const
+    {
+        return limit.wait(due, now);
+    }
+
+    void take(const rateLimit &limit, uint64_t now)
+    {
+        due = max(due, now) + limit.interval;
+    }
+};
+
+// A bucket shared between threads. Two threads may both see room for one
+// last message and both take it; the bucket then runs one interval behind,
+// which the next wait() makes up for.
+class sharedBucket
+{
+private:
+    atomic<uint64_t> due{0};
+
+public:
+    uint64_t wait(const rateLimit &limit, uint64_t now) const
+    {
+        return limit.wait(due.load(memory_order_relaxed), now);
+    }
+
+    void take(const rateLimit &limit, uint64_t now)
+    {
+        uint64_t seen = due.load(memory_order_relaxed);
+        while (!due.compare_exchange_weak(seen, max(seen, now) + limit.interval, memory_order_relaxed))
+            ;
+    }
+};
+
+// Clock for the buckets, read once per batch of messages. It must be the
+// clock the servers' deferral timers run on (CLOCK_MONOTONIC, as nowNanos()
+// and timerfd): a due time taken from a coarser clock can look past on the
+// timer's clock yet still be ahead on the limiter's, and the client would be
+// resumed and deferred again until the coarse clock caught up.
+inline uint64_t limiterNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+#endif
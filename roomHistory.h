@@ -0,0 +1,102 @@
+#ifndef ROOM_HISTORY_H
+#define ROOM_HISTORY_H
+
+// The most recent chat messages of one room, replayed to clients that join
+// it. Every message gets the room's next sequence number (the first is 1);
+// the ring keeps the last `capacity` of them. Entries are the same shared
+// buffers that were fanned out to the room (messageBuffer.h), so keeping a
+// message costs two reference counts, not a copy.
+//
+// A joiner asks for the messages after some sequence number (0: everything
+// kept) and is told the room's last number, which it can send back with
+// "since" when it reconnects to fetch only what came later. With --journal
+// every message is also written to disk and the rings are refilled from it
+// at start-up (journal.h), numbers included.
+
+#include <string>    // For std::string, std::to_string
+#include <vector>    // For std::vector
+#include <algorithm> // For std::max
+#include <cstdint>   // For uint64_t
+#include <pthread.h> // For pthread_mutex_t
+
+#include "wireProtocol.h"
+#include "journal.h"
+
+using namespace std;
+
+#define HISTORY_DEFAULT_MESSAGES 64 // per room; one sendmsg replays a full ring
+
+class roomHistory
+{
+private:
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    string room;
+    vector<wireMessage> ring; // message n lives in slot (n - 1) % capacity
+    size_t capacity = 0;
+    size_t kept = 0;   // newest messages present in the ring
+    uint64_t last = 0; // sequence number of the newest message
+
+    // Called with mutex held.
+    void keep(uint64_t sequence, const wireMessage &message)
+    {
+        kept = (sequence == last + 1) ? min(kept + 1, capacity) : min<size_t>(1, capacity);
+        last = sequence;
+        if (capacity > 0)
+            ring[(sequence - 1) % capacity] = message;
+    }
+
+public:
+    // Keeps at most messages entries; 0 keeps none but still numbers them.
+    void init(const string &name, size_t messages)
+    {
+        room = name;
+        capacity = messages;
+        ring.resize(messages);
+    }
+
+    // Adds a message and returns its sequence number. With --journal the
+    // message is queued for the disk under the same lock, so each room's
+    // records reach the journal in sequence order.
+    uint64_t record(const wireMessage &message)
+    {
+        pthread_mutex_lock(&mutex);
+        uint64_t sequence = last + 1;
+        keep(sequence, message);
+        journal.append(JOURNAL_BROADCAST, room, sequence, *message.text);
+        pthread_mutex_unlock(&mutex);
+        return sequence;
+    }
+
+    // Puts back a message read from the journal at start-up; text is the
+    // line text clients were sent, and binary clients get it as a notice.
+    void restore(uint64_t sequence, string_view text)
+    {
+        string_view line = text.substr(0, text.find('\n'));
+        wireMessage message = {makeMessage(string(text)), makeMessage(encodeFrame(FRAME_NOTICE, 0, string(line)))};
+        pthread_mutex_lock(&mutex);
+        if (sequence > last)
+            keep(sequence, message);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // Appends the kept messages numbered after `since` to out, oldest first,
+    // and returns the newest sequence number.
+    uint64_t since(uint64_t since, vector<wireMessage> &out)
+    {
+        pthread_mutex_lock(&mutex);
+        uint64_t oldest = last - kept + 1;
+        for (uint64_t sequence = max(since + 1, oldest); sequence <= last; sequence++)
+            out.push_back(ring[(sequence - 1) % capacity]);
+        uint64_t newest = last;
+        pthread_mutex_unlock(&mutex);
+        return newest;
+    }
+
+    // The notice that follows a replay.
+    static string replayNotice(size_t replayed, uint64_t newest)
+    {
+        return "Replayed " + to_string(replayed) + " earlier messages; room is at message " + to_string(newest);
+    }
+};
+
+#endif
@@ -13,10 +13,42 @@
 #include <sys/socket.h> // For socket functions (socket(), bind(), listen(), accept(), etc.)
 #include <netinet/in.h> // For sockaddr_in structure
 #include <netdb.h>      // For getaddrinfo(), gethostbyname(), etc.
+#include <sys/epoll.h>  // For epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/resource.h> // For getrlimit() to size the outbox table
+#include <fcntl.h>        // For fcntl() to make the listener non-blocking
+#include <sys/timerfd.h>  // For timerfd_create() to resume rate-limited sessions and tick the heartbeat wheel
+#include <queue>          // For std::priority_queue
+#include <atomic>         // For std::atomic connection generations
 
 // Threading Library
 #include <pthread.h> // For pthreads (multithreading)
 
+// Server options and the worker thread pool
+#include "serverConfig.h"
+#include "workerPool.h"
+// Splits received bytes into newline-delimited messages
+#include "framer.h"
+// Non-blocking per-socket reply queues
+#include "outputQueue.h"
+// Per-socket state indexed by descriptor
+#include "fdTable.h"
+// Optional length-prefixed binary protocol
+#include "wireProtocol.h"
+// Aliases and chat room membership shared by the workers
+#include "clientRegistry.h"
+// Command and @mention parsing
+#include "commandParser.h"
+// Asynchronous logging off the message path
+#include "logger.h"
+// Counters and latency histograms behind STATS
+#include "metrics.h"
+// Per-client and per-room message rate limits
+#include "rateLimiter.h"
+// PING/PONG liveness checks and --idle-timeout
+#include "heartbeat.h"
+// Coalesced join and leave notices, paged rosters
+#include "presence.h"
+
 using namespace std;
 
 #define RESET "\033[0m"
@@ -27,21 +59,108 @@ using namespace std;
 
 #define MAX_CLIENTS 5
 #define BUFFER_SIZE 4096
+#define RESERVED_DESCRIPTORS 32 // listener, poller, timers, journal, metrics and stdio
+#define MAX_EVENTS 64
+#define WRITE_EVENT_TAG 1 // low bit of epoll data.ptr: an outbox became writable
+#define DEFER_EVENT_TAG 2 // epoll data.ptr of deferTimer
+#define HEARTBEAT_EVENT_TAG 4 // epoll data.ptr of tickTimer
+#define PRESENCE_EVENT_TAG 8  // epoll data.ptr of presenceTimer
 
-enum msgType
+int clientCount = 0;
+pthread_mutex_t clientCountMutex = PTHREAD_MUTEX_INITIALIZER;
+clientRegistry registry;
+
+// Where a client is in the clientAlias() -> CONNECT -> chatting() sequence.
+enum sessionState
 {
-    BROADCAST,
-    CONNECT,
-    DISCONNECT,
-    PRIVATE,
-    EXIT
+    AWAITING_ALIAS,
+    IN_LOBBY,
+    IN_CHAT
 };
 
-int clientCount = 0;
-pthread_mutex_t clientCountMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t chatRoomMutex = PTHREAD_MUTEX_INITIALIZER;
-map<int, string> clientList;
-map<string, int> chatRoom;
+// One client connection. Its socket is registered with EPOLLONESHOT, so at
+// most one worker handles a session at any time and no thread waits on it
+// while the client is idle.
+struct session
+{
+    int sock;
+    sessionState state = AWAITING_ALIAS;
+    framer input; // received bytes not yet handled as messages
+    bool binary = false; // negotiated the binary protocol (wireProtocol.h)
+    tokenBucket rate;    // --rate
+};
+
+// A session over a rate limit. It is not armed in the poller until due, so
+// its unread lines stay in its framer and socket and TCP slows the sender
+// down. Any worker defers sessions; the poller resumes them when deferTimer
+// fires.
+struct deferral
+{
+    uint64_t due; // CLOCK_MONOTONIC, ns
+    session *client;
+
+    bool operator>(const deferral &other) const
+    {
+        return due > other.due;
+    }
+};
+
+pthread_mutex_t deferMutex = PTHREAD_MUTEX_INITIALIZER;
+priority_queue<deferral, vector<deferral>, greater<deferral>> deferred; // earliest first
+int deferTimer = -1; // timerfd set to the earliest due time
+
+// Heartbeat timers of every session. Workers arm and cancel them as sessions
+// start and end; the poller advances the wheel once a tick, when tickTimer
+// fires, and handles whatever fell due.
+fdTable<heartbeat> heartbeats;
+pthread_mutex_t wheelMutex = PTHREAD_MUTEX_INITIALIZER;
+timingWheel wheel; // guarded by wheelMutex
+int tickTimer = -1; // periodic timerfd, HEARTBEAT_TICK_MS
+
+wheelTimer &heartbeatTimer(int sock)
+{
+    return heartbeats[sock].timer;
+}
+
+// Joins and leaves waiting for their room's --presence-window to close
+// (presence.h). One lock covers every room's batch, as changes are rare next
+// to messages; the poller sends the batches that are due when presenceTimer
+// fires.
+pthread_mutex_t presenceMutex = PTHREAD_MUTEX_INITIALIZER;
+vector<chatRoom *> presenceRooms;  // rooms with a pending batch, maybe twice; guarded by presenceMutex
+uint64_t presenceDue = UINT64_MAX; // when presenceTimer is set to fire; guarded by presenceMutex
+int presenceTimer = -1;
+fdTable<uint64_t> joinBatches; // batch announcing each socket's join to its room
+
+// Replies waiting for a client's socket to accept them. Any worker may queue
+// a message for any client, so each outbox has its own lock. Outboxes are
+// reused per descriptor rather than freed, so a sender racing with a
+// disconnect finds a closed outbox instead of freed memory.
+struct outbox
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    bool open = false;
+    int sock = -1;
+    int writeFd = -1;   // dup of sock, registered for EPOLLOUT
+    outputQueue output; // guarded by mutex
+    bool overflowed = false; // queue limit hit under --overflow=disconnect
+    bool binary = false; // set once by the owning worker; senders read it under mutex
+    unsigned generation = 0; // of the connection on sock; set by openOutbox(), never 0
+};
+
+// Appends the '\n' delimiter once; the result is shared by every recipient.
+messageBuffer frameMessage(string message)
+{
+    message += "\n";
+    return makeMessage(move(message));
+}
+
+serverConfig config;
+workerPool pool;
+int pollfd = -1;
+fdTable<outbox> outboxes;
+atomic<unsigned> nextGeneration(0);
+thread_local vector<int> dirtyOutboxes; // queued to by this thread since its last flush
 
 class server
 {
@@ -86,7 +205,7 @@ public:
 
     void serverListen()
     {
-        listenid = listen(sockfd, 20);
+        listenid = listen(sockfd, SOMAXCONN);
         if (listenid != 0)
         {
             cout << RED << "Server listen failed" << RESET << endl;
@@ -94,20 +213,28 @@ public:
         }
         else
             cout << GREEN << "Server is listening" << RESET << endl;
+        // A connection that is reset before we get to it must not block the
+        // poller in accept().
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
     }
 
+    // Sets connfd to the new socket, or to -1 if there is none to take or no
+    // descriptor to take it with; the server keeps running either way.
     void acceptClient()
     {
         socklen_t clilen = sizeof(cli_addr);
         connfd = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
         if (connfd < 0)
         {
-            cout << RED << "Server accept failed" << RESET << endl;
-            exit(0);
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                serverLog.log(LOG_DEBUG, YELLOW, "Server accept found no connection: ", strerror(errno));
+            else
+                serverLog.log(LOG_ERROR, RED, "Server accept failed: ", strerror(errno));
+            connfd = -1;
         }
         else
         {
-            cout << GREEN << "Server-Client Connection Established" << RESET << endl;
+            serverLog.log(LOG_INFO, GREEN, "Server-Client Connection Established");
         }
     }
 
@@ -116,87 +243,88 @@ public:
         close(clientSocket);
     }
 
-    pair<ssize_t, string> recvAll(int clientSocket)
+    // Reads whatever the client has sent without blocking into its framer,
+    // stopping early once the framer is full; the rest stays in the socket
+    // and wakes the poller again. Returns the bytes read or -1 on a socket
+    // error; peerClosed is set once the client has closed the connection.
+    ssize_t readAvailable(int clientSocket, framer &input, bool &peerClosed)
     {
-        string message = "";
-        const size_t CHUNK_SIZE = 32;
-        char buffer[CHUNK_SIZE];
         ssize_t totalBytesRead = 0;
 
-        while (true)
+        while (!input.full())
         {
-            bzero(buffer, CHUNK_SIZE);
-            ssize_t bytesRead = read(clientSocket, buffer, CHUNK_SIZE);
+            ssize_t bytesRead = input.fill(clientSocket, MSG_DONTWAIT);
 
             if (bytesRead < 0)
             {
                 if (errno == EINTR)
-                    continue;    // Interrupted by signal, retry
-                return {-1, ""}; // Error occurred
+                    continue; // Interrupted by signal, retry
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return totalBytesRead; // Nothing more for now
+                return -1;                 // Error occurred
             }
 
             if (bytesRead == 0)
             {
-                // Connection closed by client
-                if (totalBytesRead == 0)
-                    return {0, ""};
-                break;
+                peerClosed = true; // Connection closed by client
+                return totalBytesRead;
             }
 
-            buffer[bytesRead] = '\0';
-            message.append(buffer);
             totalBytesRead += bytesRead;
-
-            // Check if we've received a complete message (ending with newline)
-            if (message.find('\n') != string::npos)
-            {
-                break;
-            }
         }
-
-        // Remove the trailing newline if present
-        if (!message.empty() && message.back() == '\n')
-        {
-            message.pop_back();
-        }
-
-        return {totalBytesRead, message};
+        return totalBytesRead;
     }
-    pair<ssize_t, string> receiveMessage(int clientSockNo, char *buffer)
+
+    // Queues a message for a client in the encoding it negotiated. It is
+    // written by flushOutboxes() at the end of the current task, or by the
+    // poller once the socket has room. broadcast marks room-wide messages,
+    // which --overflow=drop-broadcast may drop for a slow client. A sender
+    // that found the socket in a roster or by alias passes the generation it
+    // found with it, and the message is dropped if that connection has since
+    // closed and the descriptor been reused; 0 is for the socket's own worker.
+    ssize_t sendMessage(int clientSockNo, const wireMessage &wire, bool broadcast = false, unsigned generation = 0)
     {
-        return recvAll(clientSockNo);
+        if (!outboxes.contains(clientSockNo))
+            return -1;
+        outbox &box = outboxes[clientSockNo];
+        pthread_mutex_lock(&box.mutex);
+        const messageBuffer &message = wire.forClient(box.binary);
+        pushResult result = PUSH_DROPPED;
+        if (box.open && !box.overflowed && message && (generation == 0 || generation == box.generation))
+            result = box.output.push(message, broadcast, config.output);
+        if (result == PUSH_QUEUED)
+            metrics.count(MESSAGES_QUEUED);
+        if (result == PUSH_OVERFLOW)
+            box.overflowed = true; // disconnected by the next flushOutbox()
+        else if (box.output.count() >= OUTPUT_IOV_MAX)
+            box.output.flush(clientSockNo); // a full batch goes out right away
+        pthread_mutex_unlock(&box.mutex);
+        if (result == PUSH_DROPPED)
+            return -1;
+        dirtyOutboxes.push_back(clientSockNo);
+        return (result == PUSH_QUEUED) ? (ssize_t)message->size() : -1;
     }
 
-    ssize_t sendAll(int clientSocket, const string &message)
+    // Sends server text, as a FRAME_NOTICE to binary clients.
+    ssize_t sendMessage(int clientSockNo, string message)
     {
-        const char *buffer = message.c_str();
-        size_t totalLength = message.length();
-        size_t bytesSent = 0;
-        const size_t CHUNK_SIZE = 32;
-
-        while (bytesSent < totalLength)
-        {
-            size_t remainingBytes = totalLength - bytesSent;
-            size_t currentChunkSize = min(CHUNK_SIZE, remainingBytes);
-
-            ssize_t result = write(clientSocket, buffer + bytesSent, currentChunkSize);
-
-            if (result < 0)
-            {
-                if (errno == EINTR)
-                    continue; // Interrupted by signal, retry
-                return -1;    // Error occurred
-            }
-            bytesSent += result;
-        }
-
-        return bytesSent;
+        wireMessage single;
+        if (isBinaryClient(clientSockNo))
+            single.binary = makeMessage(encodeFrame(FRAME_NOTICE, 0, message));
+        else
+            single.text = frameMessage(move(message));
+        return sendMessage(clientSockNo, single);
     }
 
-    ssize_t sendMessage(int clientSockNo, string message)
+    bool isBinaryClient(int clientSockNo)
     {
-        message += "\n";
-        return sendAll(clientSockNo, message);
+        if (!outboxes.contains(clientSockNo))
+            return false;
+        outbox &box = outboxes[clientSockNo];
+        pthread_mutex_lock(&box.mutex);
+        bool binary = box.binary;
+        pthread_mutex_unlock(&box.mutex);
+        return binary;
     }
 
 } serverObject;
@@ -204,15 +332,17 @@ public:
 string msgParser(msgType command, string message, int sockSender)
 {
     string msg = "";
-    string username = clientList[sockSender];
+    string username = registry.alias(sockSender);
     switch (command)
     {
     case CONNECT:
+    case JOIN:
         msg += username;
         msg += " has joined the ChatRoom";
         break;
 
     case DISCONNECT:
+    case LEAVE:
     case EXIT:
         msg += username;
         msg += " has left the ChatRoom";
@@ -227,104 +357,105 @@ string msgParser(msgType command, string message, int sockSender)
         msg += "[" + username + ", to ALL] ";
         msg += message;
         break;
+
+    case STATS:
+    case WHO:
+        break; // answered to the sender alone
     }
     return msg;
 }
 
-void privateMsgParser(string &message, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+// Binary counterpart of msgParser(): the sender's id and the bare body or
+// alias, formatted by the client itself.
+string binaryParser(msgType command, const string &message, int sockSender)
 {
-    int index = 0;
-    while (index < message.size() && message[index] == '@')
+    userId id = registry.id(sockSender);
+    switch (command)
     {
-        string username;
-        index++; // skip the @ and go to the next character
-        while (index < message.size() && message[index] != ' ')
-        {
-            username += message[index];
-            index++; // keep traversing to build username string
-        }
+    case CONNECT:
+    case JOIN:
+        return encodeFrame(FRAME_JOIN, id, registry.alias(sockSender));
+    case DISCONNECT:
+    case LEAVE:
+    case EXIT:
+        return encodeFrame(FRAME_LEAVE, id, registry.alias(sockSender));
+    case PRIVATE:
+        return encodeFrame(FRAME_PRIVATE, id, message);
+    case BROADCAST:
+    default:
+        return encodeFrame(FRAME_BROADCAST, id, message);
+    }
+}
+
+// Formats a chat message once per protocol.
+wireMessage buildMessage(msgType command, const string &message, int sockSender)
+{
+    return {frameMessage(msgParser(command, message, sockSender)), makeMessage(binaryParser(command, message, sockSender))};
+}
 
-        if (chatRoom.find(username) != chatRoom.end())
+// Resolves the @mentions at the front of message, then trims them off so
+// only the body is left.
+void privateMsgParser(string &message, vector<connectionRef> &privateSocketNo, vector<string> &privateAliasNotFound)
+{
+    string_view rest = message;
+    string_view username;
+    while (nextMention(rest, username))
+    {
+        connectionRef receiver;
+        if (registry.findMember(username, receiver))
         {
-            int portNo = chatRoom[username];
-            privateSocketNo.push_back(portNo);
+            privateSocketNo.push_back(receiver);
         }
         else
         {
-            privateAliasNotFound.push_back(username);
+            privateAliasNotFound.emplace_back(username);
         }
-        index++; // skip the ' ' character and collect the message
-    }
-
-    if (message.size() >= index)
-    {
-        message = message.substr(index);
     }
-    else
-    {
-        message = "";
-    }
-    return;
+    message.erase(0, rest.data() - message.data());
 }
 
-msgType commandHandler(string &message, int sockSender, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+msgType commandHandler(string &message, int sockSender, vector<connectionRef> &privateSocketNo, vector<string> &privateAliasNotFound, uint64_t &since, size_t &page)
 {
-    msgType command = BROADCAST;
-
-    if (message[0] == '@')
-    {
-        command = PRIVATE;
+    parsedCommand parsed = parseCommand(message);
+    if (parsed.command == PRIVATE)
         privateMsgParser(message, privateSocketNo, privateAliasNotFound);
-        return command;
-    }
-    else if (message.size() >= 7 && message.substr(0, 7) == "CONNECT")
-    {
-        command = CONNECT;
-        return command;
-    }
-    else if (message.size() >= 10 && message.substr(0, 10) == "DISCONNECT")
-    {
-        command = DISCONNECT;
-        return command;
-    }
-    else if (message.size() >= 4 && message.substr(0, 4) == "EXIT")
-    {
-        command = EXIT;
-        return command;
-    }
-    return command;
+    else if (parsed.command == JOIN)
+        message = string(parsed.rest); // the room name
+    since = parsed.since;
+    page = parsed.page;
+    return parsed.command;
 }
 
-void privateMessage(vector<int> &sockReceiver, string message)
+void privateMessage(vector<connectionRef> &sockReceiver, const wireMessage &message)
 {
     ssize_t Nsend;
-    for (auto clientSocketNo : sockReceiver)
+    for (auto receiver : sockReceiver)
     {
-        Nsend = serverObject.sendMessage(clientSocketNo, message);
+        Nsend = serverObject.sendMessage(receiver.sock, message, false, receiver.generation);
     }
     return;
 }
 
-void broadcast(int sockSender, string message)
+// Sends to everyone in the sender's room except the sender.
+void broadcast(int sockSender, const wireMessage &message)
 {
-    ssize_t Nsend;
-    for (auto clientDetails : chatRoom)
+    registry.forEachMember(registry.roomOf(sockSender), [&](const roomMember &member)
     {
-        if (clientDetails.second != sockSender)
+        if (member.sock != sockSender)
         {
-            Nsend = serverObject.sendMessage(clientDetails.second, message);
+            serverObject.sendMessage(member.sock, message, true, member.generation);
         }
-    }
+    });
     return;
 }
 
-void globalChat(string message)
+// Sends to everyone in a room.
+void roomChat(chatRoom *room, const wireMessage &message)
 {
-    ssize_t Nsend;
-    for (auto clientDetails : chatRoom)
+    registry.forEachMember(room, [&](const roomMember &member)
     {
-        Nsend = serverObject.sendMessage(clientDetails.second, message);
-    }
+        serverObject.sendMessage(member.sock, message, true, member.generation);
+    });
     return;
 }
 
@@ -354,153 +485,657 @@ void userNotPresent(vector<string> &privateAliasNotFound, int sockSender)
     return;
 }
 
-bool chatting(int sockSender, char *buffer)
+void enterRoom(int socketNumber, string_view name, uint64_t since);
+void announcePresence(int sock, chatRoom *room, bool joined);
+void flushPresence(chatRoom *room);
+string getAllInChat(chatRoom *room, size_t page);
+
+// Handles one line from a client in the chat room. Returns the next state,
+// or IN_LOBBY with exitRequested set when the client typed EXIT.
+sessionState chatting(int sockSender, string message, bool &exitRequested)
 {
-    pair<ssize_t, string> receiveReturn;
-    ssize_t nSend, nRec;
-    string message;
     msgType command;
-    vector<int> privateSocketNo;
+    vector<connectionRef> privateSocketNo;
     vector<string> privateAliasNotFound;
-    bool returnValue = false;
+    uint64_t since;
+    size_t page;
+    string line = journal.started() ? message : string(); // keeps the mentions for the journal
 
-    message = msgParser(CONNECT, "", sockSender);
-    globalChat(message);
-    cout << message << endl;
+    serverLog.log(LOG_INFO, "", registry.alias(sockSender), ": ", message);
+    command = commandHandler(message, sockSender, privateSocketNo, privateAliasNotFound, since, page);
+    metrics.lap(RECEIVE_TO_PARSE);
+    wireMessage framed = buildMessage(command, message, sockSender); // shared by every recipient
+    serverLog.log(LOG_DEBUG, CYAN, "\tSending: ", *framed.text);
+    chatRoom *room = registry.roomOf(sockSender);
+    // Nobody may hear from the client before they hear that it joined.
+    if ((command == BROADCAST || command == PRIVATE) && !room->presence.announced(joinBatches[sockSender]))
+        flushPresence(room);
 
-    bool disconnectFlag = false;
-    while (!disconnectFlag)
+    switch (command)
     {
-        privateSocketNo.clear();
-        privateAliasNotFound.clear();
+    case BROADCAST:
+        room->history.record(framed);
+        broadcast(sockSender, framed);
+        metrics.lap(PARSE_TO_FANOUT);
+        break;
+    case PRIVATE:
+        privateMessage(privateSocketNo, framed);
+        metrics.lap(PARSE_TO_FANOUT);
+        journal.appendPrivate(line, message, *framed.text);
+        userNotPresent(privateAliasNotFound, sockSender);
+        break;
+    case STATS:
+        serverObject.sendMessage(sockSender, metrics.summary());
+        break;
+    case WHO:
+    {
+        string members = getAllInChat(room, page);
+        serverObject.sendMessage(sockSender, members.empty() ? "No roster page " + to_string(page) + "." : members);
+        break;
+    }
+    case EXIT:
+        exitRequested = true;
+    case DISCONNECT:
+    case LEAVE:
+        announcePresence(sockSender, room, false);
+        registry.leave(sockSender);
+        return IN_LOBBY;
+    case JOIN:
+        if (message.empty())
+        {
+            serverObject.sendMessage(sockSender, "Usage: JOIN <room>, at most " + to_string(MAX_ROOM_NAME) + " characters.");
+        }
+        else if (room->name == message)
+        {
+            serverObject.sendMessage(sockSender, "You are already in room " + message + ".");
+        }
+        else
+        {
+            announcePresence(sockSender, room, false);
+            registry.leave(sockSender);
+            enterRoom(sockSender, message, since);
+        }
+        break;
+    case CONNECT:
+        break;
+    }
+    return IN_CHAT;
+}
 
-        receiveReturn = serverObject.receiveMessage(sockSender, buffer);
-        nRec = receiveReturn.first;
-        message = receiveReturn.second;
+// Tells a binary client the id and alias of everyone already in a room so
+// it can name the senders of later frames.
+void sendRoster(int socketNumber, chatRoom *room)
+{
+    string roster;
+    registry.forEachMember(room, [&](const roomMember &member)
+    {
+        roster += encodeFrame(FRAME_MEMBER, member.id, member.alias);
+    });
+    wireMessage frames;
+    frames.binary = makeMessage(move(roster));
+    serverObject.sendMessage(socketNumber, frames);
+}
 
-        cout << clientList[sockSender] << ": " << message << endl;
-        command = commandHandler(message, sockSender, privateSocketNo, privateAliasNotFound);
-        message = msgParser(command, message, sockSender);
-        cout << CYAN << "\tSending: " << message << RESET << endl;
+// Lists one page of a room in alias order; returns an empty string if the
+// room is empty or the page is past its end.
+string getAllInChat(chatRoom *room, size_t page)
+{
+    vector<string> aliases;
+    registry.forEachMember(room, [&](const roomMember &member)
+    {
+        aliases.push_back(member.alias);
+    });
+    return rosterPage(aliases, page);
+}
 
-        switch (command)
-        {
-        case BROADCAST:
-            broadcast(sockSender, message);
-            break;
-        case PRIVATE:
-            privateMessage(privateSocketNo, message);
-            userNotPresent(privateAliasNotFound, sockSender);
-            break;
-        case EXIT:
-            returnValue = true;
-        case DISCONNECT:
-            globalChat(message);
-            disconnectFlag = true;
-            break;
-        }
+void promptAlias(int socketNumber)
+{
+    serverObject.sendMessage(socketNumber, "Enter Alias: ");
+}
+
+// Handles the reply to "Enter Alias: ". Returns true once an alias is assigned.
+bool clientAlias(int socketNumber, const string &name)
+{
+    ssize_t sentByteSize;
+    if (!registry.claimAlias(socketNumber, name, outboxes[socketNumber].generation))
+    {
+        sentByteSize = serverObject.sendMessage(socketNumber, "Alias already taken.");
+        promptAlias(socketNumber);
+        return false;
     }
-    return returnValue;
+    sentByteSize = serverObject.sendMessage(socketNumber, "Alias Assigned");
+    serverLog.log(LOG_INFO, YELLOW, "Assigned Socket ", socketNumber, " : ", name);
+    return true;
+}
+
+// Sends a joiner the room's messages after `since`, then the number to ask
+// for next time. They are queued back to back, so the outbox gathers them
+// into as few sendmsg calls as it can. The client is already a member, so a
+// message another worker was still fanning out may arrive twice, never not
+// at all.
+void replayHistory(int socketNumber, chatRoom *room, uint64_t since)
+{
+    vector<wireMessage> missed;
+    uint64_t newest = room->history.since(since, missed);
+    for (const wireMessage &message : missed)
+        serverObject.sendMessage(socketNumber, message, true);
+    serverObject.sendMessage(socketNumber, roomHistory::replayNotice(missed.size(), newest));
 }
 
-string getAllInChat()
+// Tells a client who is in a room, puts it there, announces it and replays
+// what it missed. A text client is only shown the first page of the room;
+// WHO shows the rest.
+void enterRoom(int socketNumber, string_view name, uint64_t since)
 {
-    string message = "";
-    for (auto it : chatRoom)
+    chatRoom *room = registry.openRoom(name);
+    string members = getAllInChat(room, 1);
+    if (!members.empty())
     {
-        message += it.first;
-        message += " ";
+        serverLog.log(LOG_INFO, YELLOW, members);
+        serverObject.sendMessage(socketNumber, members);
+        if (serverObject.isBinaryClient(socketNumber))
+            sendRoster(socketNumber, room);
     }
-    message += "currently in Chat Room";
-    return message;
+    registry.join(socketNumber, room);
+    announcePresence(socketNumber, room, true);
+    replayHistory(socketNumber, room, since);
 }
 
-void clientAlias(int socketNumber, char *buffer)
+// Handles a line from a client that has an alias but is not in a chat room.
+sessionState lobby(int socketNumber, const string &message, bool &exitRequested)
 {
-    pair<ssize_t, string> receiveReturn;
-    ssize_t receivedByteSize, sentByteSize;
-    string name;
-    bool reEnterAlias = true;
-    while (reEnterAlias)
+    ssize_t sentByteSize;
+    serverLog.log(LOG_INFO, YELLOW, registry.alias(socketNumber), ": ", message);
+
+    parsedCommand parsed = parseCommand(message);
+    msgType command = parsed.command;
+    if (command == CONNECT || (command == JOIN && !parsed.rest.empty()))
     {
-        reEnterAlias = false;
-        sentByteSize = serverObject.sendMessage(socketNumber, "Enter Alias: ");
-        receiveReturn = serverObject.receiveMessage(socketNumber, buffer);
-        receivedByteSize = receiveReturn.first;
-        name = receiveReturn.second;
-        if (receivedByteSize < 0)
-        {
-            continue;
-        }
-        for (auto it : clientList)
-        {
-            if (it.second == name)
-            {
-                sentByteSize = serverObject.sendMessage(socketNumber, "Alias already taken.");
-                reEnterAlias = true;
-                continue;
-            }
-        }
+        enterRoom(socketNumber, (command == CONNECT) ? DEFAULT_ROOM : parsed.rest, parsed.since);
+        return IN_CHAT;
     }
-    clientList[socketNumber] = name;
-    sentByteSize = serverObject.sendMessage(socketNumber, "Alias Assigned");
-    cout << YELLOW << "Assigned Socket " << socketNumber << " : " << name << RESET << endl;
-    return;
+    else if (command == JOIN)
+    {
+        sentByteSize = serverObject.sendMessage(socketNumber, "Usage: JOIN <room>, at most " + to_string(MAX_ROOM_NAME) + " characters.");
+    }
+    else if (command == STATS)
+    {
+        sentByteSize = serverObject.sendMessage(socketNumber, metrics.summary());
+    }
+    else if (command == EXIT)
+    {
+        exitRequested = true;
+    }
+    else
+    {
+        sentByteSize = serverObject.sendMessage(socketNumber, "You are not in Chat Room, Type CONNECT or JOIN <room>");
+    }
+    return IN_LOBBY;
 }
 
-void *handleClient(void *socketDescription)
+// Writes as much of an outbox as its socket accepts without blocking. The
+// rest is written when the poller sees EPOLLOUT on the outbox's writeFd.
+void flushOutbox(outbox &box)
 {
-    int socketNumber = *(int *)socketDescription;
-    char buffer[BUFFER_SIZE];
-    pair<ssize_t, string> receiveReturn;
-    string message;
-    ssize_t receivedByteSize, sentByteSize;
-    bool isEXIT = false;
+    pthread_mutex_lock(&box.mutex);
+    if (box.open && box.overflowed)
+    {
+        // Tell the client why if there is room, then shut the socket down;
+        // the worker that owns the session sees EOF and ends it as usual.
+        box.output.flush(box.sock);
+        string notice = "\nDisconnected: you were not reading messages fast enough.\n";
+        send(box.sock, notice.c_str(), notice.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        box.output.clear();
+        box.open = false;
+        shutdown(box.sock, SHUT_RDWR);
+        serverLog.log(LOG_WARN, RED, "Socket ", box.sock, " is not reading its messages; disconnecting");
+    }
+    else if (box.open && !box.output.empty())
+    {
+        metrics.record(QUEUE_DEPTH, box.output.count());
+        if (box.output.flush(box.sock) == FLUSH_FAILED)
+            box.output.clear(); // the reading side notices the dead peer and ends the session
+    }
+    pthread_mutex_unlock(&box.mutex);
+}
 
-    clientAlias(socketNumber, buffer);
+// Flushes every client this thread queued messages for, once each, so a
+// burst of lines handled in one task costs one gathered send per recipient.
+void flushOutboxes()
+{
+    sort(dirtyOutboxes.begin(), dirtyOutboxes.end());
+    dirtyOutboxes.erase(unique(dirtyOutboxes.begin(), dirtyOutboxes.end()), dirtyOutboxes.end());
+    for (int sock : dirtyOutboxes)
+        flushOutbox(outboxes[sock]);
+    dirtyOutboxes.clear();
+}
 
-    while (!isEXIT)
+// The outbox watches a dup of the socket so that EPOLLOUT can be edge
+// triggered independently of the session's one-shot EPOLLIN registration.
+bool openOutbox(int sock)
+{
+    int writeFd = dup(sock);
+    if (writeFd < 0)
+        return false;
+    outbox &box = outboxes[sock];
+    pthread_mutex_lock(&box.mutex);
+    box.open = true;
+    box.overflowed = false;
+    box.binary = false;
+    box.sock = sock;
+    do
+        box.generation = ++nextGeneration;
+    while (box.generation == 0);
+    box.writeFd = writeFd;
+    box.output = outputQueue(); // also resets the drop counter
+    pthread_mutex_unlock(&box.mutex);
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.ptr = (void *)((uintptr_t)&box | WRITE_EVENT_TAG);
+    epoll_ctl(pollfd, EPOLL_CTL_ADD, writeFd, &ev);
+    return true;
+}
+
+// Makes a last non-blocking attempt to deliver queued replies (e.g. the
+// client's own "has left" notice), then drops the rest.
+void closeOutbox(int sock)
+{
+    outbox &box = outboxes[sock];
+    pthread_mutex_lock(&box.mutex);
+    if (box.output.dropped() > 0)
+        serverLog.log(LOG_WARN, YELLOW, "Socket ", sock, " missed ", box.output.dropped(), " messages (output queue full)");
+    box.output.flush(sock);
+    box.output.clear();
+    box.open = false;
+    close(box.writeFd);
+    box.writeFd = -1;
+    pthread_mutex_unlock(&box.mutex);
+}
+
+void endSession(session *client)
+{
+    int socketNumber = client->sock;
+    if (client->state == IN_CHAT)
     {
-        receiveReturn = serverObject.receiveMessage(socketNumber, buffer);
-        receivedByteSize = receiveReturn.first;
-        message = receiveReturn.second;
-        if (receivedByteSize < 0)
+        // Connection dropped without EXIT: tell the room the client left.
+        chatRoom *room = registry.roomOf(socketNumber);
+        registry.leave(socketNumber);
+        announcePresence(socketNumber, room, false);
+    }
+    serverLog.log(LOG_INFO, YELLOW, registry.alias(socketNumber), ": is EXITING");
+    registry.releaseAlias(socketNumber);
+    if (config.heartbeat.enabled())
+    {
+        // Before close(), so the poller never checks a reused descriptor.
+        pthread_mutex_lock(&wheelMutex);
+        wheel.cancel(socketNumber);
+        pthread_mutex_unlock(&wheelMutex);
+    }
+    closeOutbox(socketNumber);
+    close(socketNumber); // also removes it from the epoll set
+    delete client;
+    metrics.count(CONNECTIONS_CLOSED);
+    pthread_mutex_lock(&clientCountMutex);
+    clientCount--;
+    pthread_mutex_unlock(&clientCountMutex);
+}
+
+// Answers a client's request for the binary protocol; the reply is the last
+// text it receives.
+void acceptBinary(session *client)
+{
+    serverObject.sendMessage(client->sock, WIRE_HELLO);
+    client->binary = true;
+    outbox &box = outboxes[client->sock];
+    pthread_mutex_lock(&box.mutex);
+    box.binary = true;
+    pthread_mutex_unlock(&box.mutex);
+}
+
+// Waits for the next readable event on this session's socket.
+void rearmSession(session *client)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = client;
+    epoll_ctl(pollfd, EPOLL_CTL_MOD, client->sock, &ev);
+}
+
+// Sets a one-shot timerfd to fire at `due` (CLOCK_MONOTONIC, ns). Called
+// with the lock that guards the timer's due time held.
+void setTimerAt(int timer, uint64_t due)
+{
+    struct itimerspec at;
+    memset(&at, 0, sizeof(at));
+    at.it_value.tv_sec = due / 1000000000ull;
+    at.it_value.tv_nsec = due % 1000000000ull;
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &at, NULL);
+}
+
+void deferSession(session *client, uint64_t due)
+{
+    metrics.count(CLIENTS_DEFERRED);
+    pthread_mutex_lock(&deferMutex);
+    if (deferred.empty() || due < deferred.top().due)
+        setTimerAt(deferTimer, due);
+    deferred.push({due, client});
+    pthread_mutex_unlock(&deferMutex);
+}
+
+// Runs on the poller when deferTimer fires: every session whose wait is over
+// goes back to the workers, which take its next messages.
+void resumeDeferred()
+{
+    uint64_t expirations;
+    if (read(deferTimer, &expirations, sizeof(expirations)) < 0)
+        return;
+    vector<session *> ready;
+    uint64_t now = nowNanos();
+    pthread_mutex_lock(&deferMutex);
+    while (!deferred.empty() && deferred.top().due <= now)
+    {
+        ready.push_back(deferred.top().client);
+        deferred.pop();
+    }
+    if (!deferred.empty())
+        setTimerAt(deferTimer, deferred.top().due);
+    pthread_mutex_unlock(&deferMutex);
+    for (session *client : ready)
+        pool.submit(client);
+}
+
+// A session's heartbeat timer went off: ping it, disconnect it or check
+// again later. Called by the poller with wheelMutex held. Disconnecting only
+// shuts the socket down; the worker that next reads it sees the end of the
+// stream and ends the session as if the client had hung up.
+void checkHeartbeat(int sock)
+{
+    uint64_t next = 0;
+    switch (heartbeats[sock].check(config.heartbeat, wheel.now(), next))
+    {
+    case HEARTBEAT_PING:
+        serverObject.sendMessage(sock, pingMessage());
+        break;
+    case HEARTBEAT_DEAD:
+        serverLog.log(LOG_WARN, YELLOW, "Socket ", sock, " did not answer PING; disconnecting");
+        shutdown(sock, SHUT_RDWR);
+        return;
+    case HEARTBEAT_IDLE:
+        serverObject.sendMessage(sock, "Disconnected: no messages for too long.");
+        flushOutbox(outboxes[sock]);
+        serverLog.log(LOG_INFO, YELLOW, "Socket ", sock, " was idle; disconnecting");
+        shutdown(sock, SHUT_RDWR);
+        return;
+    case HEARTBEAT_WAIT:
+        break;
+    }
+    wheel.arm(sock, next);
+}
+
+// Runs on the poller when tickTimer fires.
+void runHeartbeats()
+{
+    uint64_t expirations;
+    if (read(tickTimer, &expirations, sizeof(expirations)) < 0)
+        return;
+    pthread_mutex_lock(&wheelMutex);
+    wheel.advance(heartbeatTick(), checkHeartbeat);
+    pthread_mutex_unlock(&wheelMutex);
+    flushOutboxes();
+}
+
+// Starts sending a room's pending presence batch, if it has one. Called
+// with presenceMutex held; the caller sends notice once it has let go.
+bool takePresence(chatRoom *room, uint64_t now, wireMessage &notice)
+{
+    if (!room->presence.pending())
+        return false;
+    string text, frames;
+    room->presence.take(text, frames, now, config.presenceWindow);
+    serverLog.log(LOG_INFO, "", text);
+    notice = {frameMessage(move(text)), makeMessage(move(frames))};
+    return true;
+}
+
+// Tells a room that a client joined or left it: at once if the room has
+// been quiet for --presence-window, otherwise together with the changes that
+// follow once the window closes.
+void announcePresence(int sock, chatRoom *room, bool joined)
+{
+    uint64_t now = nowNanos();
+    wireMessage notice;
+    bool ready = false;
+    pthread_mutex_lock(&presenceMutex);
+    bool wasPending = room->presence.pending();
+    if (joined)
+        joinBatches[sock] = room->presence.batch();
+    if (room->presence.add(joined, registry.id(sock), registry.alias(sock), now))
+        ready = takePresence(room, now, notice);
+    else if (!wasPending)
+    {
+        presenceRooms.push_back(room);
+        if (room->presence.due() < presenceDue)
         {
-            continue;
+            presenceDue = room->presence.due();
+            setTimerAt(presenceTimer, presenceDue);
         }
+    }
+    pthread_mutex_unlock(&presenceMutex);
+    if (ready)
+        roomChat(room, notice);
+}
 
-        cout << YELLOW << clientList[socketNumber] << ": " << message << RESET << endl;
+// Sends a room's pending batch ahead of its window, before a message from a
+// client the batch announces.
+void flushPresence(chatRoom *room)
+{
+    wireMessage notice;
+    pthread_mutex_lock(&presenceMutex);
+    bool ready = takePresence(room, nowNanos(), notice);
+    pthread_mutex_unlock(&presenceMutex);
+    if (ready)
+        roomChat(room, notice);
+}
 
-        if (message.substr(0, 7) == "CONNECT")
+// Runs on the poller when presenceTimer fires: sends every batch whose window
+// has closed and sets the timer for the next.
+void runPresence()
+{
+    uint64_t expirations;
+    if (read(presenceTimer, &expirations, sizeof(expirations)) < 0)
+        return;
+    vector<pair<chatRoom *, wireMessage>> ready;
+    uint64_t now = nowNanos();
+    pthread_mutex_lock(&presenceMutex);
+    sort(presenceRooms.begin(), presenceRooms.end());
+    presenceRooms.erase(unique(presenceRooms.begin(), presenceRooms.end()), presenceRooms.end());
+    presenceDue = UINT64_MAX;
+    size_t kept = 0;
+    for (chatRoom *room : presenceRooms)
+    {
+        if (!room->presence.pending())
+            continue; // sent early
+        if (room->presence.due() <= now)
         {
-            if (chatRoom.size() > 0)
-            {
-                message = getAllInChat();
-                cout << YELLOW << message << RESET << endl;
-                sentByteSize = serverObject.sendMessage(socketNumber, message);
-            }
-            chatRoom[clientList[socketNumber]] = socketNumber;
-            isEXIT = chatting(socketNumber, buffer);
-            chatRoom.erase(clientList[socketNumber]);
+            ready.emplace_back(room, wireMessage());
+            takePresence(room, now, ready.back().second);
+            continue;
         }
-        else if (isEXIT || (message.size() >= 4 && message.substr(0, 4) == "EXIT"))
+        presenceRooms[kept++] = room;
+        presenceDue = min(presenceDue, room->presence.due());
+    }
+    presenceRooms.resize(kept);
+    if (presenceDue != UINT64_MAX)
+        setTimerAt(presenceTimer, presenceDue);
+    pthread_mutex_unlock(&presenceMutex);
+    for (auto &batch : ready)
+        roomChat(batch.first, batch.second);
+    flushOutboxes();
+}
+
+// Nanoseconds until a client, and the room it is in, may send another
+// message; 0 if it may now.
+uint64_t limitWait(session *client, uint64_t now)
+{
+    uint64_t wait = client->rate.wait(config.clientLimit, now);
+    chatRoom *room = registry.roomOf(client->sock);
+    if (room != NULL)
+        wait = max(wait, room->rate.wait(config.roomLimit, now));
+    return wait;
+}
+
+void chargeLimits(session *client, uint64_t now)
+{
+    client->rate.take(config.clientLimit, now);
+    chatRoom *room = registry.roomOf(client->sock);
+    if (room != NULL)
+        room->rate.take(config.roomLimit, now);
+}
+
+// Worker task: runs every complete line a ready client has sent through its
+// session state machine, then hands the socket back to the poller, or to
+// the deferred queue if the client ran over a rate limit.
+void handleClient(void *task)
+{
+    session *client = (session *)task;
+    bool peerClosed = false;
+    ssize_t receivedByteSize = serverObject.readAvailable(client->sock, client->input, peerClosed);
+    bool isEXIT = false;
+    if (receivedByteSize > 0)
+    {
+        metrics.count(BYTES_RECEIVED, receivedByteSize);
+        heartbeats[client->sock].heard.store(heartbeatTick(), memory_order_relaxed);
+    }
+    metrics.received();
+
+    bool limited = config.clientLimit.enabled() || config.roomLimit.enabled();
+    uint64_t now = limited ? limiterNanos() : 0;
+    uint64_t wait = 0;
+    string_view line;
+    int status;
+    while (!isEXIT)
+    {
+        if (limited && client->input.buffered() > 0 && (wait = limitWait(client, now)) > 0)
+            break;
+        if ((status = nextMessage(client->input, client->binary, line)) == 0)
+            break;
+        if (status < 0)
         {
-            isEXIT = true;
+            serverLog.log(LOG_WARN, RED, "Socket ", client->sock, " sent a malformed frame");
+            receivedByteSize = -1;
+            break;
         }
-        else
+        metrics.count(MESSAGES_RECEIVED);
+        if (limited)
+            chargeLimits(client, now);
+        string message(line);
+        if (!message.empty() && message.back() == '\r')
+            message.pop_back();
+        // A frame may carry newlines, which would split the line for text clients.
+        if (client->binary)
+            message.erase(remove(message.begin(), message.end(), '\n'), message.end());
+        // Heard already; a PONG is not a message and does not keep a client
+        // from --idle-timeout.
+        if (message == WIRE_PONG)
+            continue;
+        heartbeats[client->sock].spoke.store(heartbeatTick(), memory_order_relaxed);
+
+        switch (client->state)
         {
-            sentByteSize = serverObject.sendMessage(socketNumber, "You are not in Chat Room, Type CONNECT");
+        case AWAITING_ALIAS:
+            if (message == WIRE_HELLO && !client->binary)
+                acceptBinary(client);
+            else if (clientAlias(client->sock, message))
+                client->state = IN_LOBBY;
+            break;
+        case IN_LOBBY:
+            client->state = lobby(client->sock, message, isEXIT);
+            break;
+        case IN_CHAT:
+            client->state = chatting(client->sock, message, isEXIT);
+            break;
         }
     }
-    cout << YELLOW << clientList[socketNumber] << ": is EXITING" << RESET << endl;
-    clientList.erase(socketNumber);
-    close(socketNumber);
-    free(socketDescription);
+
+    size_t dropped = client->input.takeRejected();
+    if (dropped > 0 && !isEXIT)
+    {
+        serverLog.log(LOG_WARN, YELLOW, "Socket ", client->sock, " sent ", dropped, " oversized line(s)");
+        serverObject.sendMessage(client->sock, oversizeNotice(dropped, config.maxMessage));
+    }
+
+    // A client that hung up right after a burst still has its deferred
+    // lines handled; the next read sees the end of the stream again.
+    if (isEXIT || receivedByteSize < 0 || (peerClosed && wait == 0))
+        endSession(client);
+    else if (wait > 0)
+        deferSession(client, now + wait);
+    else
+        rearmSession(client);
+    flushOutboxes();
+    metrics.flushed();
+}
+
+// Accepts a client and registers it with the poller.
+void admitClient()
+{
+    ssize_t nSend;
+    serverObject.acceptClient();
+    if (serverObject.connfd < 0)
+    {
+        return;
+    }
     pthread_mutex_lock(&clientCountMutex);
-    clientCount--;
+    if (clientCount >= config.maxClients || !outboxes.fits(serverObject.connfd) || !openOutbox(serverObject.connfd))
+    {
+        serverLog.log(LOG_WARN, RED, "Maximum Number of Clients Reached");
+        string fullMsg = "EXIT Processed\n";
+        nSend = send(serverObject.connfd, fullMsg.c_str(), fullMsg.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        pthread_mutex_unlock(&clientCountMutex);
+        close(serverObject.connfd);
+        return;
+    }
+    clientCount++;
     pthread_mutex_unlock(&clientCountMutex);
-    pthread_exit(NULL);
-    return NULL;
+    metrics.count(CONNECTIONS_OPENED);
+
+    session *client = new session();
+    client->sock = serverObject.connfd;
+    client->input.setLimit(config.maxMessage, config.oversize);
+    promptAlias(client->sock);
+    if (config.heartbeat.enabled())
+    {
+        uint64_t now = heartbeatTick();
+        heartbeats[client->sock].start(now);
+        pthread_mutex_lock(&wheelMutex);
+        wheel.arm(client->sock, heartbeats[client->sock].firstCheck(config.heartbeat, now));
+        pthread_mutex_unlock(&wheelMutex);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = client;
+    epoll_ctl(pollfd, EPOLL_CTL_ADD, client->sock, &ev);
+    flushOutboxes();
+}
+
+// Opens --journal and refills the room histories from it.
+void openJournal()
+{
+    size_t restored = 0;
+    bool opened = journal.start(config.journalDir, [&](journalKind kind, string_view room, uint64_t sequence, string_view text)
+    {
+        if (kind != JOURNAL_BROADCAST)
+            return;
+        registry.openRoom(room)->history.restore(sequence, text);
+        restored++;
+    });
+    if (!opened)
+    {
+        cout << RED << "Could not open journal " << config.journalDir << ": " << strerror(errno) << RESET << endl;
+        exit(0);
+    }
+    cout << GREEN << "Journal " << config.journalDir << " opened, " << restored << " room messages restored." << RESET << endl;
 }
 
 int main(int argc, char *argv[])
@@ -508,8 +1143,14 @@ int main(int argc, char *argv[])
     if (argc < 2)
     {
         cout << RED << "Port Number is missing" << RESET << endl;
+        config.usage(argv[0]);
         exit(0);
     }
+    if (!config.parse(argc, argv))
+    {
+        exit(0);
+    }
+    signal(SIGPIPE, SIG_IGN); // a peer that hung up must not kill the server
     serverObject.getPort(argv);
     serverObject.socketNumber();
     if (serverObject.sockfd < 0)
@@ -527,29 +1168,83 @@ int main(int argc, char *argv[])
         exit(0);
     }
     cout << string(50, '-') << endl;
-    pthread_t clientThread;
-    ssize_t nSend;
+    serverLog.start(config.logging);
+    metrics.startExporter(config.metricsFile, config.metricsInterval);
+
+    // Size the outbox table to the descriptor limit.
+    struct rlimit fdLimit;
+    int maxDescriptors = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur != RLIM_INFINITY)
+        maxDescriptors = min<long>(fdLimit.rlim_cur, 1 << 20);
+    // Each client holds its socket and the outbox's dup of it.
+    int descriptorClients = max(1, (maxDescriptors - RESERVED_DESCRIPTORS) / 2);
+    if (config.maxClients > descriptorClients)
+    {
+        cout << YELLOW << "Descriptor limit " << maxDescriptors << " allows " << descriptorClients << " clients; --max-clients lowered to match" << RESET << endl;
+        config.maxClients = descriptorClients;
+    }
+    outboxes.init(maxDescriptors);
+    registry.init(maxDescriptors, config.historyMessages);
+    heartbeats.init(maxDescriptors);
+    joinBatches.init(maxDescriptors);
+    if (!config.journalDir.empty())
+        openJournal();
+
+    // The main thread only waits for readiness; the workers do all reading,
+    // parsing and sending.
+    pollfd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    epoll_ctl(pollfd, EPOLL_CTL_ADD, serverObject.sockfd, &ev);
+    deferTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ev.data.ptr = (void *)DEFER_EVENT_TAG;
+    epoll_ctl(pollfd, EPOLL_CTL_ADD, deferTimer, &ev);
+    presenceTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ev.data.ptr = (void *)PRESENCE_EVENT_TAG;
+    epoll_ctl(pollfd, EPOLL_CTL_ADD, presenceTimer, &ev);
+    if (config.heartbeat.enabled())
+    {
+        wheel.init(heartbeatTimer, HEARTBEAT_WHEEL_SLOTS, heartbeatTick());
+        tickTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        struct itimerspec every;
+        every.it_value.tv_sec = every.it_interval.tv_sec = HEARTBEAT_TICK_MS / 1000;
+        every.it_value.tv_nsec = every.it_interval.tv_nsec = (HEARTBEAT_TICK_MS % 1000) * 1000000;
+        timerfd_settime(tickTimer, 0, &every, NULL);
+        ev.data.ptr = (void *)HEARTBEAT_EVENT_TAG;
+        epoll_ctl(pollfd, EPOLL_CTL_ADD, tickTimer, &ev);
+    }
+    pool.start(config.workers, handleClient);
+
+    struct epoll_event events[MAX_EVENTS];
     while (true)
     {
-        serverObject.acceptClient();
-        if (serverObject.connfd < 0)
+        int ready = epoll_wait(pollfd, events, MAX_EVENTS, -1);
+        if (ready < 0)
         {
-            continue;
+            if (errno == EINTR)
+                continue;
+            serverLog.log(LOG_ERROR, RED, "Epoll wait error");
+            break;
         }
-        pthread_mutex_lock(&clientCountMutex);
-        if (clientCount >= 5)
+        for (int n = 0; n < ready; n++)
         {
-            cout << RED << "Maximum Number of Clients Reached" << RESET << endl;
-            nSend = serverObject.sendMessage(serverObject.connfd, "EXIT Processed");
-            pthread_mutex_unlock(&clientCountMutex);
-            continue;
+            uintptr_t target = (uintptr_t)events[n].data.ptr;
+            if (target == 0)
+                admitClient();
+            else if (target == DEFER_EVENT_TAG)
+                resumeDeferred();
+            else if (target == HEARTBEAT_EVENT_TAG)
+                runHeartbeats();
+            else if (target == PRESENCE_EVENT_TAG)
+                runPresence();
+            else if (target & WRITE_EVENT_TAG)
+                flushOutbox(*(outbox *)(target & ~(uintptr_t)WRITE_EVENT_TAG));
+            else
+                pool.submit(events[n].data.ptr);
         }
-        clientCount++;
-        pthread_mutex_unlock(&clientCountMutex);
-        int *newSock = new int(serverObject.connfd);
-        pthread_create(&clientThread, NULL, handleClient, (void *)newSock);
-        pthread_detach(clientThread); // to free resources on client termination
     }
+    serverLog.finish();
     serverObject.closeServer(serverObject.sockfd);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,191 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "outputQueue.h" // For outputLimits
+#include "logger.h"      // For logLevel
+#include "metrics.h"     // For METRICS_DEFAULT_INTERVAL
+#include "roomHistory.h" // For HISTORY_DEFAULT_MESSAGES
+#include "framer.h"      // For oversizePolicy
+#include "rateLimiter.h" // For rateLimit
+#include "heartbeat.h"   // For heartbeatLimits
+#include "presence.h"    // For PRESENCE_DEFAULT_WINDOW_MS
+
+using namespace std;
+
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 5
+#endif
+
+#define INPUT_DEFAULT_MAX_MESSAGE 4096 // bytes in one client line or frame payload
+
+// Event loop used by serverSelect to wait on client sockets
+enum ioEngine
+{
+    SELECT_ENGINE,
+    EPOLL_ENGINE,
+    URING_ENGINE
+};
+
+class serverConfig
+{
+public:
+    int port = 0;
+    ioEngine engine = SELECT_ENGINE;
+    int maxClients = MAX_CLIENTS;
+    int threads = 1; // event loops (epoll engine only)
+    int workers = sysconf(_SC_NPROCESSORS_ONLN); // server.cpp worker pool size
+    outputLimits output;                         // per-client output queue bounds
+    logLevel logging = LOG_INFO;                 // least severe line that is logged
+    string metricsFile;                          // Prometheus text file, rewritten periodically
+    int metricsInterval = METRICS_DEFAULT_INTERVAL;
+    size_t historyMessages = HISTORY_DEFAULT_MESSAGES; // kept per room for joiners
+    string journalDir;                                 // message journal, off when empty
+    size_t maxMessage = INPUT_DEFAULT_MAX_MESSAGE;     // longest line a client may send
+    oversizePolicy oversize = OVERSIZE_REJECT;         // what happens to a longer one
+    unsigned rate = 0, burst = 0, roomRate = 0;        // messages a second, 0: unlimited
+    rateLimit clientLimit;                             // built from rate and burst
+    rateLimit roomLimit;                               // built from roomRate
+    heartbeatLimits heartbeat;                         // PING after silence, reap the unresponsive
+    uint64_t presenceWindow = PRESENCE_DEFAULT_WINDOW_MS * 1000000ull; // ns joins and leaves are collected for
+
+    // True for a whole number, 0 included.
+    static bool isCount(const string &value)
+    {
+        return !value.empty() && value.find_first_not_of("0123456789") == string::npos;
+    }
+
+    // A number of seconds in heartbeat ticks, rounded up.
+    static uint64_t seconds(const string &value)
+    {
+        return (atol(value.c_str()) * 1000ull + HEARTBEAT_TICK_MS - 1) / HEARTBEAT_TICK_MS;
+    }
+
+    // Parses "<port> [--option=value ...]". Returns false on a bad option.
+    bool parse(int argc, char *argv[])
+    {
+        port = atoi(argv[1]);
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            size_t eq = arg.find('=');
+            string key = arg.substr(0, eq);
+            string value = (eq == string::npos) ? "" : arg.substr(eq + 1);
+
+            if (key == "--engine" && value == "select")
+                engine = SELECT_ENGINE;
+            else if (key == "--engine" && value == "epoll")
+                engine = EPOLL_ENGINE;
+            else if (key == "--engine" && value == "uring")
+                engine = URING_ENGINE;
+            else if (key == "--max-clients" && atoi(value.c_str()) > 0)
+                maxClients = atoi(value.c_str());
+            else if (key == "--threads" && atoi(value.c_str()) > 0)
+                threads = atoi(value.c_str());
+            else if (key == "--workers" && atoi(value.c_str()) > 0)
+                workers = atoi(value.c_str());
+            else if (key == "--max-output-bytes" && atol(value.c_str()) > 0)
+                output.maxBytes = atol(value.c_str());
+            else if (key == "--max-output-messages" && atol(value.c_str()) > 0)
+                output.maxMessages = atol(value.c_str());
+            else if (key == "--overflow" && value == "drop-oldest")
+                output.policy = OVERFLOW_DROP_OLDEST;
+            else if (key == "--overflow" && value == "drop-broadcast")
+                output.policy = OVERFLOW_DROP_BROADCAST;
+            else if (key == "--overflow" && value == "disconnect")
+                output.policy = OVERFLOW_DISCONNECT;
+            else if (key == "--history" && isCount(value))
+                historyMessages = atol(value.c_str());
+            else if (key == "--journal" && !value.empty())
+                journalDir = value;
+            else if (key == "--max-message" && atol(value.c_str()) > 0)
+                maxMessage = atol(value.c_str());
+            else if (key == "--oversize" && value == "reject")
+                oversize = OVERSIZE_REJECT;
+            else if (key == "--oversize" && value == "split")
+                oversize = OVERSIZE_SPLIT;
+            else if (key == "--rate" && atoi(value.c_str()) > 0)
+                rate = atoi(value.c_str());
+            else if (key == "--burst" && atoi(value.c_str()) > 0)
+                burst = atoi(value.c_str());
+            else if (key == "--room-rate" && atoi(value.c_str()) > 0)
+                roomRate = atoi(value.c_str());
+            else if (key == "--ping-interval" && isCount(value))
+                heartbeat.interval = seconds(value);
+            else if (key == "--ping-timeout" && atoi(value.c_str()) > 0)
+                heartbeat.timeout = seconds(value);
+            else if (key == "--idle-timeout" && isCount(value))
+                heartbeat.idle = seconds(value);
+            else if (key == "--presence-window" && isCount(value))
+                presenceWindow = atol(value.c_str()) * 1000000ull;
+            else if (key == "--metrics-file" && !value.empty())
+                metricsFile = value;
+            else if (key == "--metrics-interval" && atoi(value.c_str()) > 0)
+                metricsInterval = atoi(value.c_str());
+            else if (key == "--log-level" && value == "debug")
+                logging = LOG_DEBUG;
+            else if (key == "--log-level" && value == "info")
+                logging = LOG_INFO;
+            else if (key == "--log-level" && value == "warn")
+                logging = LOG_WARN;
+            else if (key == "--log-level" && value == "error")
+                logging = LOG_ERROR;
+            else if (key == "--log-level" && value == "off")
+                logging = LOG_OFF;
+            else
+            {
+                cout << "Unknown option: " << arg << endl;
+                usage(argv[0]);
+                return false;
+            }
+        }
+        if (threads > 1 && engine != EPOLL_ENGINE)
+        {
+            cout << "--threads requires --engine=epoll" << endl;
+            return false;
+        }
+        clientLimit = rateLimit(rate, burst ? burst : rate);
+        roomLimit = rateLimit(roomRate, roomRate);
+        return true;
+    }
+
+    void usage(const char *program)
+    {
+        cout << "usage: " << program << " <port_number> [options]" << endl;
+        cout << "  --engine=select|epoll|uring  event loop backend (default select)" << endl;
+        cout << "  --max-clients=N              maximum simultaneous clients (default " << MAX_CLIENTS << ")" << endl;
+        cout << "  --threads=N                  epoll event loops, one per core (default 1)" << endl;
+        cout << "  --workers=N                  worker threads for server.cpp (default: cores)" << endl;
+        cout << "  --max-output-bytes=N         per-client unsent bytes (default " << OUTPUT_DEFAULT_BYTES << ")" << endl;
+        cout << "  --max-output-messages=N      per-client unsent messages (default " << OUTPUT_DEFAULT_MESSAGES << ")" << endl;
+        cout << "  --overflow=drop-oldest|drop-broadcast|disconnect" << endl;
+        cout << "                               what a full client queue gives up (default drop-oldest)" << endl;
+        cout << "  --history=N                  recent messages replayed to joiners, per room (default " << HISTORY_DEFAULT_MESSAGES << ")" << endl;
+        cout << "  --journal=DIR                keep every message in an on-disk journal in DIR (default off)" << endl;
+        cout << "  --max-message=N              longest line a client may send, in bytes (default " << INPUT_DEFAULT_MAX_MESSAGE << ")" << endl;
+        cout << "  --oversize=reject|split      drop longer lines or pass them on in pieces (default reject)" << endl;
+        cout << "  --rate=N                     messages a second taken from each client (default unlimited)" << endl;
+        cout << "  --burst=N                    messages a client may send at once (default: the rate)" << endl;
+        cout << "  --room-rate=N                messages a second taken from each room's members together (default unlimited)" << endl;
+        cout << "  --ping-interval=N            seconds of silence before a client is pinged, 0: never (default off)" << endl;
+        cout << "  --ping-timeout=N             seconds a client has to answer a ping (default " << HEARTBEAT_DEFAULT_TIMEOUT << ")" << endl;
+        cout << "  --idle-timeout=N             disconnect clients that send no message for N seconds (default off)" << endl;
+        cout << "  --presence-window=MS         joins and leaves within MS ms are announced together, 0: each alone (default " << PRESENCE_DEFAULT_WINDOW_MS << ")" << endl;
+        cout << "  --log-level=debug|info|warn|error|off" << endl;
+        cout << "                               least severe line logged (default info)" << endl;
+        cout << "  --metrics-file=PATH          write Prometheus metrics to PATH (default off)" << endl;
+        cout << "  --metrics-interval=N         seconds between metrics file rewrites (default " << METRICS_DEFAULT_INTERVAL << ")" << endl;
+    }
+};
+
+// Tells a client its lines over --max-message were dropped.
+inline string oversizeNotice(size_t dropped, size_t limit)
+{
+    return to_string(dropped) + " message(s) longer than " + to_string(limit) + " bytes were dropped.";
+}
+
+#endif
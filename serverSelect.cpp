@@ -13,8 +13,49 @@
 #include <sys/socket.h> // For socket functions (socket(), bind(), listen(), accept(), etc.)
 #include <netinet/in.h> // For sockaddr_in structure
 #include <netdb.h>      // For getaddrinfo(), gethostbyname(), etc.
+#include <sys/epoll.h>  // For epoll_create1(), epoll_ctl(), epoll_wait()
+#include <fcntl.h>      // For fcntl() to make sockets non-blocking
+#include <sys/eventfd.h> // For eventfd() used to wake other event loops
+#include <sys/resource.h> // For getrlimit() to size the connection table
 
-// No threading library is needed since we're using select().
+// Threading is only used by the multi-reactor mode (--threads=N); each thread
+// runs its own epoll loop.
+#include <pthread.h> // For pthreads
+#include <atomic>    // For std::atomic
+#include <deque>     // For std::deque
+#include <queue>     // For std::priority_queue
+#include <memory>    // For std::unique_ptr
+
+// Server options (engine, client limit)
+#include "serverConfig.h"
+// io_uring rings for the uring engine
+#include "uring.h"
+// Lock-free queues between event loops
+#include "spscQueue.h"
+// Splits received bytes into newline-delimited messages
+#include "framer.h"
+// Non-blocking per-socket reply queues
+#include "outputQueue.h"
+// Per-socket state indexed by descriptor
+#include "fdTable.h"
+// Optional length-prefixed binary protocol
+#include "wireProtocol.h"
+// Alias -> user id index
+#include "userTable.h"
+// Command and @mention parsing
+#include "commandParser.h"
+// Asynchronous logging off the message path
+#include "logger.h"
+// Counters and latency histograms behind STATS
+#include "metrics.h"
+// Recent messages of each room, replayed to joiners
+#include "roomHistory.h"
+// Per-client and per-room message rate limits
+#include "rateLimiter.h"
+// PING/PONG liveness checks on a timing wheel
+#include "heartbeat.h"
+// Coalesced join and leave notices, paged rosters
+#include "presence.h"
 
 using namespace std;
 
@@ -26,19 +67,164 @@ using namespace std;
 
 #define MAX_CLIENTS 5
 #define BUFFER_SIZE 4096
+#define MAX_EVENTS 64
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024 // provided receive buffers, must be a power of two
+#define URING_BUFFER_GROUP 1
+#define CROSS_QUEUE_SIZE 4096 // messages in flight between two event loops
+
+atomic<int> clientCount(0);
+// Where a connection is in the handshake: it first answers "Enter Alias: ",
+// then waits in the lobby for CONNECT or JOIN, then chats. Each complete line
+// moves it along, so no engine ever waits on one client.
+enum sessionState
+{
+    AWAITING_ALIAS,
+    IN_LOBBY,
+    IN_CHAT
+};
+
+// A user's entry in the alias directory.
+struct userRecord
+{
+    int sock = -1;
+    roomId room = NO_ROOM;
+    size_t rosterIndex = 0; // position in rooms[room]->members
+};
+
+// The alias and room directories are shared by every event loop and guarded
+// by registryMutex. Message fan-out never touches them (see reactor::members).
+// Rooms are never removed, so a room id posted to another loop stays valid,
+// and so does its roomState, which needs no registry lock.
+struct roomState
+{
+    roomHistory history;    // has its own lock
+    sharedBucket rate;      // --room-rate, charged by every loop
+    vector<userId> members; // everyone in the room, for rosters; guarded by registryMutex
+};
+
+pthread_mutex_t registryMutex = PTHREAD_MUTEX_INITIALIZER;
+userTable<userRecord> users;
+userTable<roomState *> rooms;
+
+// Gather list of an io_uring sendmsg; the kernel may read it until the
+// completion arrives, so it lives outside the stack.
+struct uringSend
+{
+    struct msghdr msg;
+    struct iovec iov[OUTPUT_IOV_MAX];
+    outputQueue retired; // queue of a socket closed while this send was in flight
+};
+
+// Per-socket state, indexed by file descriptor. Only the event loop that
+// accepted a socket reads or writes its entry.
+struct connection
+{
+    bool active = false;
+    framer input;            // received bytes not yet handled as messages
+    unsigned generation = 0; // tells completions for a reused descriptor apart
+    sessionState state = AWAITING_ALIAS;
+    int owner = 0;           // index of the event loop serving this socket
+    userId user = NO_USER;   // entry in users once an alias is assigned
+    string alias;            // copy of the user's alias for the message path
+    roomId room = NO_ROOM;   // chat room the client is in, if any
+    roomHistory *history = NULL; // that room's recent messages
+    sharedBucket *roomRate = NULL; // and its rate limit
+    tokenBucket rate;        // --rate
+    bool deferred = false;   // over a rate limit; not read until resumed
+    int memberIndex = -1;    // position in the owning loop's members[room]
+    presenceBatch *presence = NULL; // the owning loop's batch for that room
+    uint64_t joinBatch = 0;  // and the batch that announces this client's join
+    outputQueue output;      // replies not yet accepted by the socket
+    bool flushQueued = false;  // already on the owning loop's dirty list
+    bool writeWatched = false; // select: in the write set until the queue drains
+    bool overflowed = false;   // queue limit hit under --overflow=disconnect
+    bool binary = false;       // negotiated the binary protocol (wireProtocol.h)
+    unique_ptr<uringSend> send; // uring: gather list, allocated on first send
+    bool sending = false;       // uring: a sendmsg is in flight
+    bool receiving = false;     // uring: a multishot recv is armed
+    string held;                // uring: bytes received while deferred that did not fit in input
+};
+
+fdTable<connection> connections;
+fdTable<heartbeat> heartbeats; // kept apart from connection, which is reset by assignment
+atomic<unsigned> nextGeneration(0);
+
+wheelTimer &heartbeatTimer(int sock)
+{
+    return heartbeats[sock].timer;
+}
+
+// A private recipient, resolved while registryMutex is held.
+struct recipient
+{
+    int sock;
+    int owner;
+    unsigned generation;
+};
+
+// Work posted from one event loop to another.
+enum crossKind
+{
+    FANOUT, // deliver to every member of a room in the receiving loop
+    DIRECT  // deliver to one socket if it is still the same connection
+};
+
+struct crossMessage
+{
+    crossKind kind = FANOUT;
+    roomId room = NO_ROOM;
+    int sock = -1;
+    unsigned generation = 0;
+    wireMessage message; // shared with the sending loop's own recipients
+};
+
+// A client of this loop waiting out a rate limit.
+struct deferral
+{
+    uint64_t due; // CLOCK_MONOTONIC, ns
+    int sock;
+    unsigned generation; // tells a socket closed and reused meanwhile apart
 
-enum msgType
+    bool operator>(const deferral &other) const
+    {
+        return due > other.due;
+    }
+};
+
+// One event loop. Sockets are owned by the loop that accepted them; other
+// loops reach them only through that loop's inbox queues.
+struct reactor
 {
-    BROADCAST,
-    CONNECT,
-    DISCONNECT,
-    PRIVATE,
-    EXIT
+    int index = 0;
+    int epollfd = -1;
+    int listenfd = -1;
+    int wakefd = -1;                         // eventfd signalled after posting to this loop
+    vector<vector<int>> members;             // members[room]: this loop's sockets in that room
+    vector<unique_ptr<presenceBatch>> presence; // presence[room]: this loop's joins and leaves not yet announced
+    vector<roomId> presenceRooms;            // rooms with a pending batch, maybe twice
+    vector<spscQueue<crossMessage> *> inbox; // inbox[p] is written only by loop p
+    vector<deque<crossMessage>> outbox;      // posts waiting for space in loop p's queue
+    vector<bool> wake;                       // loop p must be signalled at the end of this iteration
+    vector<int> dirty;                       // sockets with replies queued during this iteration
+    priority_queue<deferral, vector<deferral>, greater<deferral>> deferred; // earliest first
+    timingWheel wheel; // heartbeat timers of this loop's sockets
+    uint64_t tick = 0; // heartbeatTick() when the loop last woke up
+    pthread_t thread;
 };
+vector<reactor *> reactors;
+thread_local reactor *currentReactor = NULL;
+
+serverConfig config;
+fd_set master_set; // sockets watched by select()
+fd_set write_set;  // select: sockets whose output queue is waiting for space
+int fdmax = 0;
 
-int clientCount = 0;
-map<int, string> clientList; // Maps socket to alias (empty until assigned)
-map<string, int> chatRoom;   // Maps alias to socket (only if in chat room)
+ssize_t queueMessage(int sock, const messageBuffer &message, bool broadcast);
+void flushConnection(int sock);
+void clientHungUp(int sock);
+void runTimers();
+int timerTimeout();
 
 class server
 {
@@ -64,6 +250,32 @@ public:
         {
             cout << GREEN << "Socket was successfully created." << RESET << endl;
         }
+        setReuse(sockfd);
+    }
+
+    // SO_REUSEPORT lets every event loop bind its own listening socket to the
+    // same port; the kernel then spreads new connections across them.
+    void setReuse(int sock)
+    {
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (config.threads > 1)
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
+    // Opens an extra listening socket on the bound port for another event loop.
+    int openListener()
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+            return -1;
+        setReuse(sock);
+        if (bind(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || listen(sock, SOMAXCONN) != 0)
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
     }
 
     void socketBind()
@@ -84,7 +296,7 @@ public:
 
     void serverListen()
     {
-        listenid = listen(sockfd, 20);
+        listenid = listen(sockfd, SOMAXCONN);
         if (listenid != 0)
         {
             cout << RED << "Server listen failed" << RESET << endl;
@@ -101,12 +313,13 @@ public:
         int newSock = accept(sockfd, (struct sockaddr *)&cli_addr, &clilen);
         if (newSock < 0)
         {
-            cout << RED << "Server accept failed" << RESET << endl;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) // already gone again
+                serverLog.log(LOG_ERROR, RED, "Server accept failed");
             return -1;
         }
         else
         {
-            cout << GREEN << "Server-Client Connection Established" << RESET << endl;
+            serverLog.log(LOG_INFO, GREEN, "Server-Client Connection Established");
         }
         return newSock;
     }
@@ -116,53 +329,52 @@ public:
         close(clientSocket);
     }
 
-    // Receives a message from a client. It reads until a newline is found.
-    pair<ssize_t, string> receiveMessage(int clientSockNo, char *buffer)
+    // Sends a message to the specified client. Admitted clients get it
+    // through their output queue; anyone else (e.g. a rejected connection)
+    // gets a single non-blocking send.
+    // broadcast marks room-wide messages, which --overflow=drop-broadcast may
+    // drop for a slow client.
+    ssize_t sendMessage(int clientSockNo, const messageBuffer &message, bool broadcast = false)
     {
-        string message;
-        ssize_t bytesRead;
-        while (true)
-        {
-            bzero(buffer, BUFFER_SIZE);
-            bytesRead = read(clientSockNo, buffer, BUFFER_SIZE - 1);
-            if (bytesRead <= 0)
-            {
-                return {bytesRead, message};
-            }
-            buffer[bytesRead] = '\0';
-            message.append(buffer);
-            if (message.find('\n') != string::npos)
-            {
-                break;
-            }
-        }
-        if (!message.empty())
-            message.pop_back(); // remove trailing newline
-        return {message.size(), message};
+        if (connections.contains(clientSockNo) && connections[clientSockNo].active)
+            return queueMessage(clientSockNo, message, broadcast);
+        return send(clientSockNo, message->data(), message->size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    // Sends a chat message in the encoding the client negotiated.
+    ssize_t sendMessage(int clientSockNo, const wireMessage &message, bool broadcast = false)
+    {
+        bool binary = connections.contains(clientSockNo) && connections[clientSockNo].binary;
+        return sendMessage(clientSockNo, message.forClient(binary), broadcast);
     }
 
-    // Sends a message to the specified client.
+    // Sends server text, as a FRAME_NOTICE to binary clients.
     ssize_t sendMessage(int clientSockNo, string message)
     {
-        ssize_t bytesSent;
-        // Use message.size() rather than sizeof(message)
-        bytesSent = write(clientSockNo, message.c_str(), message.size());
-        return bytesSent;
+        if (connections.contains(clientSockNo) && connections[clientSockNo].binary)
+        {
+            if (!message.empty() && message.back() == '\n')
+                message.pop_back();
+            return sendMessage(clientSockNo, makeMessage(encodeFrame(FRAME_NOTICE, 0, message)));
+        }
+        return sendMessage(clientSockNo, makeMessage(move(message)));
     }
 } serverObject;
 
 string msgParser(msgType command, string message, int sockSender)
 {
     string msg = "";
-    string username = clientList[sockSender];
+    string username = connections[sockSender].alias;
     switch (command)
     {
     case CONNECT:
+    case JOIN:
         msg += username;
         msg += " has joined the ChatRoom\n";
         break;
 
     case DISCONNECT:
+    case LEAVE:
         msg += username;
         msg += " has left the ChatRoom\n";
         break;
@@ -183,93 +395,194 @@ string msgParser(msgType command, string message, int sockSender)
         msg += message;
         msg += "\n";
         break;
+
+    case STATS:
+    case WHO:
+        break; // answered to the sender alone
     }
     return msg;
 }
 
-void privateMsgParser(string &message, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+// Binary counterpart of msgParser(): the sender's id and the bare body or
+// alias, formatted by the client itself. Connection generations double as ids.
+string binaryParser(msgType command, const string &message, int sockSender)
 {
-    int index = 0;
-    while (index < message.size() && message[index] == '@')
+    connection &conn = connections[sockSender];
+    switch (command)
     {
-        string username;
-        index++; // skip the @
-        while (index < message.size() && message[index] != ' ')
-        {
-            username += message[index];
-            index++; // build the username string
-        }
-        if (chatRoom.find(username) != chatRoom.end())
+    case CONNECT:
+    case JOIN:
+        return encodeFrame(FRAME_JOIN, conn.generation, conn.alias);
+    case DISCONNECT:
+    case LEAVE:
+    case EXIT:
+        return encodeFrame(FRAME_LEAVE, conn.generation, conn.alias);
+    case PRIVATE:
+        return encodeFrame(FRAME_PRIVATE, conn.generation, message);
+    case BROADCAST:
+    default:
+        return encodeFrame(FRAME_BROADCAST, conn.generation, message);
+    }
+}
+
+// Formats a chat message once per protocol.
+wireMessage buildMessage(msgType command, const string &message, int sockSender)
+{
+    return {makeMessage(msgParser(command, message, sockSender)), makeMessage(binaryParser(command, message, sockSender))};
+}
+
+// Resolves the @mentions at the front of message, then trims them off so
+// only the body is left.
+void privateMsgParser(string &message, vector<recipient> &privateSocketNo, vector<string> &privateAliasNotFound)
+{
+    string_view rest = message;
+    string_view username;
+    pthread_mutex_lock(&registryMutex);
+    while (nextMention(rest, username))
+    {
+        userId user = users.find(username);
+        if (user != NO_USER && users[user].room != NO_ROOM)
         {
-            int sock = chatRoom[username];
-            privateSocketNo.push_back(sock);
+            // Owner and generation are stable while the user is in the room.
+            int sock = users[user].sock;
+            privateSocketNo.push_back({sock, connections[sock].owner, connections[sock].generation});
         }
         else
         {
-            privateAliasNotFound.push_back(username);
+            privateAliasNotFound.emplace_back(username);
         }
-        index++; // skip the space
     }
-    if (index < message.size())
-        message = message.substr(index);
-    else
-        message = "";
+    pthread_mutex_unlock(&registryMutex);
+    message.erase(0, rest.data() - message.data());
 }
 
-msgType commandHandler(string &message, int sockSender, vector<int> &privateSocketNo, vector<string> &privateAliasNotFound)
+msgType commandHandler(string &message, int sockSender, vector<recipient> &privateSocketNo, vector<string> &privateAliasNotFound, uint64_t &since, size_t &page)
 {
-    msgType command = BROADCAST;
-    if (!message.empty() && message[0] == '@')
-    {
-        command = PRIVATE;
+    parsedCommand parsed = parseCommand(message);
+    if (parsed.command == PRIVATE)
         privateMsgParser(message, privateSocketNo, privateAliasNotFound);
-        return command;
-    }
-    else if (message.size() >= 7 && message.substr(0, 7) == "CONNECT")
-    {
-        command = CONNECT;
-        return command;
-    }
-    else if (message.size() >= 10 && message.substr(0, 10) == "DISCONNECT")
+    else if (parsed.command == JOIN)
+        message = string(parsed.rest); // the room name
+    since = parsed.since;
+    page = parsed.page;
+    return parsed.command;
+}
+
+// Queues a message for another event loop; it is handed over (and that loop
+// woken) in flushPosts() at the end of the current iteration.
+void post(int target, crossMessage &item)
+{
+    reactor *self = currentReactor;
+    if (!self->outbox[target].empty() || !reactors[target]->inbox[self->index]->push(item))
+        self->outbox[target].push_back(item);
+    self->wake[target] = true;
+}
+
+// Hands queued posts to their loops and signals each woken loop once.
+// Returns true if some loop's queue was full and posts are still waiting.
+bool flushPosts()
+{
+    reactor *self = currentReactor;
+    bool waiting = false;
+    for (int target = 0; target < (int)reactors.size(); target++)
     {
-        command = DISCONNECT;
-        return command;
+        deque<crossMessage> &pending = self->outbox[target];
+        while (!pending.empty() && reactors[target]->inbox[self->index]->push(pending.front()))
+            pending.pop_front();
+        if (!pending.empty())
+            waiting = true;
+        if (self->wake[target])
+        {
+            uint64_t one = 1;
+            write(reactors[target]->wakefd, &one, sizeof(one));
+            self->wake[target] = false;
+        }
     }
-    else if (message.size() >= 4 && message.substr(0, 4) == "EXIT")
+    return waiting;
+}
+
+// Sends to every member of a room owned by this loop except `skipSock`.
+// Every member's queue shares the one buffer.
+void localFanout(roomId room, int skipSock, const wireMessage &message)
+{
+    ssize_t Nsend;
+    if (room >= currentReactor->members.size())
+        return;
+    for (auto member : currentReactor->members[room])
     {
-        command = EXIT;
-        return command;
+        if (member != skipSock)
+            Nsend = serverObject.sendMessage(member, message, true);
     }
-    return command;
 }
 
-void privateMessage(vector<int> &sockReceiver, string message)
+// Lets every other loop fan the message out to its own members of the room.
+void remoteFanout(roomId room, const wireMessage &message)
 {
-    ssize_t Nsend;
-    for (auto clientSocketNo : sockReceiver)
+    for (int target = 0; target < (int)reactors.size(); target++)
     {
-        Nsend = serverObject.sendMessage(clientSocketNo, message);
+        if (target == currentReactor->index)
+            continue;
+        crossMessage item;
+        item.kind = FANOUT;
+        item.room = room;
+        item.message = message;
+        post(target, item);
     }
 }
 
-void broadcast(int sockSender, string message)
+void privateMessage(vector<recipient> &sockReceiver, const wireMessage &message)
 {
     ssize_t Nsend;
-    for (auto clientDetails : chatRoom)
+    for (auto receiver : sockReceiver)
     {
-        if (clientDetails.second != sockSender)
+        if (receiver.owner == currentReactor->index)
         {
-            Nsend = serverObject.sendMessage(clientDetails.second, message);
+            if (connections[receiver.sock].active && connections[receiver.sock].generation == receiver.generation)
+                Nsend = serverObject.sendMessage(receiver.sock, message);
+        }
+        else
+        {
+            crossMessage item;
+            item.kind = DIRECT;
+            item.sock = receiver.sock;
+            item.generation = receiver.generation;
+            item.message = message;
+            post(receiver.owner, item);
         }
     }
 }
 
-void globalChat(string message)
+// Sends to everyone in the sender's room except the sender.
+void broadcast(int sockSender, const wireMessage &message)
 {
-    ssize_t Nsend;
-    for (auto clientDetails : chatRoom)
+    roomId room = connections[sockSender].room;
+    localFanout(room, sockSender, message);
+    remoteFanout(room, message);
+}
+
+// Sends to everyone in a room.
+void roomChat(roomId room, const wireMessage &message)
+{
+    localFanout(room, -1, message);
+    remoteFanout(room, message);
+}
+
+// Delivers everything other loops posted to this one.
+void drainInbox()
+{
+    reactor *self = currentReactor;
+    uint64_t count;
+    read(self->wakefd, &count, sizeof(count));
+    crossMessage item;
+    for (int source = 0; source < (int)reactors.size(); source++)
     {
-        Nsend = serverObject.sendMessage(clientDetails.second, message);
+        while (self->inbox[source]->pop(item))
+        {
+            if (item.kind == FANOUT)
+                localFanout(item.room, -1, item.message);
+            else if (connections[item.sock].active && connections[item.sock].generation == item.generation)
+                serverObject.sendMessage(item.sock, item.message);
+        }
     }
 }
 
@@ -294,215 +607,1241 @@ void userNotPresent(vector<string> &privateAliasNotFound, int sockSender)
     serverObject.sendMessage(sockSender, message);
 }
 
-// Processes alias assignment for a client that hasn't yet set an alias.
-void clientAlias(int socketNumber, char *buffer)
+// Assigns the alias unless another client holds it; the check and the insert
+// happen under one lock so two loops cannot hand out the same alias.
+bool claimAlias(int socketNumber, const string &name)
+{
+    userRecord record;
+    record.sock = socketNumber;
+    pthread_mutex_lock(&registryMutex);
+    userId user = users.add(name, record);
+    pthread_mutex_unlock(&registryMutex);
+    if (user == NO_USER)
+        return false;
+    connections[socketNumber].user = user;
+    connections[socketNumber].alias = name;
+    return true;
+}
+
+// Tells a binary client the id and alias of everyone already in a room so
+// it can name the senders of later frames.
+void sendRoster(int sock, roomId room)
+{
+    string roster;
+    pthread_mutex_lock(&registryMutex);
+    // Generations are stable while the user is in the room.
+    for (userId user : rooms[room]->members)
+        roster += encodeFrame(FRAME_MEMBER, connections[users[user].sock].generation, users.alias(user));
+    pthread_mutex_unlock(&registryMutex);
+    if (!roster.empty())
+        serverObject.sendMessage(sock, makeMessage(move(roster)));
+}
+
+// Lists one page of a room in alias order; returns an empty string if the
+// room is empty or the page is past its end.
+string getAllInChat(roomId room, size_t page)
+{
+    vector<string> aliases;
+    pthread_mutex_lock(&registryMutex);
+    aliases.reserve(rooms[room]->members.size());
+    for (userId user : rooms[room]->members)
+        aliases.emplace_back(users.alias(user));
+    pthread_mutex_unlock(&registryMutex);
+    return rosterPage(aliases, page);
+}
+
+// Returns the id of a room, creating the room on first use.
+roomId openRoom(string_view name)
 {
-    pair<ssize_t, string> receiveReturn;
-    ssize_t receivedByteSize, sentByteSize;
-    string name;
-    bool reEnterAlias = true;
-    while (reEnterAlias)
+    pthread_mutex_lock(&registryMutex);
+    roomId room = rooms.find(name);
+    if (room == NO_ROOM)
     {
-        reEnterAlias = false;
-        sentByteSize = serverObject.sendMessage(socketNumber, "Enter Alias: ");
-        receiveReturn = serverObject.receiveMessage(socketNumber, buffer);
-        receivedByteSize = receiveReturn.first;
-        name = receiveReturn.second;
-        if (receivedByteSize <= 0)
-            return;
-        // Remove any newline/carriage return characters.
-        name.erase(remove(name.begin(), name.end(), '\n'), name.end());
-        name.erase(remove(name.begin(), name.end(), '\r'), name.end());
-        for (auto it : clientList)
-        {
-            if (it.second == name)
-            {
-                sentByteSize = serverObject.sendMessage(socketNumber, "Alias already taken.\n");
-                reEnterAlias = true;
-                break;
-            }
-        }
+        roomState *state = new roomState();
+        state->history.init(string(name), config.historyMessages);
+        room = rooms.add(string(name), state);
     }
-    clientList[socketNumber] = name;
-    sentByteSize = serverObject.sendMessage(socketNumber, "Alias Assigned\n");
-    cout << YELLOW << "Assigned Socket " << socketNumber << " : " << name << RESET << endl;
+    pthread_mutex_unlock(&registryMutex);
+    return room;
 }
 
-int main(int argc, char *argv[])
+void joinChat(int sock, roomId room)
 {
-    if (argc < 2)
+    connection &conn = connections[sock];
+    pthread_mutex_lock(&registryMutex);
+    users[conn.user].room = room;
+    users[conn.user].rosterIndex = rooms[room]->members.size();
+    rooms[room]->members.push_back(conn.user);
+    conn.history = &rooms[room]->history;
+    conn.roomRate = &rooms[room]->rate;
+    pthread_mutex_unlock(&registryMutex);
+    if (room >= currentReactor->members.size())
     {
-        cout << RED << "Port Number is missing" << RESET << endl;
-        exit(0);
+        currentReactor->members.resize(room + 1);
+        currentReactor->presence.resize(room + 1);
     }
-    serverObject.getPort(argv);
-    serverObject.socketNumber();
-    if (serverObject.sockfd < 0)
+    if (!currentReactor->presence[room])
+        currentReactor->presence[room].reset(new presenceBatch());
+    conn.presence = currentReactor->presence[room].get();
+    conn.room = room;
+    conn.state = IN_CHAT;
+    conn.memberIndex = currentReactor->members[room].size();
+    currentReactor->members[room].push_back(sock);
+}
+
+void leaveChat(int sock)
+{
+    connection &conn = connections[sock];
+    if (conn.room == NO_ROOM)
+        return;
+    pthread_mutex_lock(&registryMutex);
+    // Swap-remove keeps leaving O(1), here and in this loop's members.
+    vector<userId> &roster = rooms[conn.room]->members;
+    userId moved = roster.back();
+    roster[users[conn.user].rosterIndex] = moved;
+    users[moved].rosterIndex = users[conn.user].rosterIndex;
+    roster.pop_back();
+    users[conn.user].room = NO_ROOM;
+    pthread_mutex_unlock(&registryMutex);
+    vector<int> &members = currentReactor->members[conn.room];
+    int last = members.back();
+    members[conn.memberIndex] = last;
+    connections[last].memberIndex = conn.memberIndex;
+    members.pop_back();
+    conn.room = NO_ROOM;
+    conn.state = IN_LOBBY;
+    conn.history = NULL;
+    conn.roomRate = NULL;
+    conn.memberIndex = -1;
+    conn.presence = NULL;
+}
+
+// Sends a joiner the room's messages after `since`, then the number to ask
+// for next time. They are queued back to back, so the output queue gathers
+// them into as few sendmsg calls as it can. A message another loop was still
+// fanning out as the client joined may arrive twice, never not at all.
+void replayHistory(int sock, uint64_t since)
+{
+    vector<wireMessage> missed;
+    uint64_t newest = connections[sock].history->since(since, missed);
+    for (const wireMessage &message : missed)
+        serverObject.sendMessage(sock, message, true);
+    serverObject.sendMessage(sock, roomHistory::replayNotice(missed.size(), newest) + "\n");
+}
+
+// Sends the batch of this loop's joins and leaves in a room, if it has one.
+void sendPresence(roomId room, uint64_t now)
+{
+    presenceBatch &batch = *currentReactor->presence[room];
+    if (!batch.pending())
+        return;
+    string text, frames;
+    batch.take(text, frames, now, config.presenceWindow);
+    serverLog.log(LOG_INFO, "", text);
+    roomChat(room, {makeMessage(text + "\n"), makeMessage(move(frames))});
+}
+
+// Tells a room that a client of this loop joined or left it: at once if the
+// loop's batch for the room has been quiet for --presence-window, otherwise
+// together with the changes that follow once the window closes.
+void announcePresence(int sock, roomId room, bool joined)
+{
+    presenceBatch &batch = *currentReactor->presence[room];
+    connection &conn = connections[sock];
+    uint64_t now = nowNanos();
+    bool wasPending = batch.pending();
+    if (joined)
+        conn.joinBatch = batch.batch();
+    if (batch.add(joined, conn.generation, conn.alias, now))
+        sendPresence(room, now);
+    else if (!wasPending)
+        currentReactor->presenceRooms.push_back(room);
+}
+
+// Sends every batch of this loop whose window has closed.
+void runPresence()
+{
+    vector<roomId> &pending = currentReactor->presenceRooms;
+    if (pending.empty())
+        return;
+    uint64_t now = nowNanos();
+    sort(pending.begin(), pending.end());
+    pending.erase(unique(pending.begin(), pending.end()), pending.end());
+    size_t kept = 0;
+    for (roomId room : pending)
     {
-        exit(0);
+        presenceBatch &batch = *currentReactor->presence[room];
+        if (batch.pending() && batch.due() <= now)
+            sendPresence(room, now);
+        else if (batch.pending())
+            pending[kept++] = room;
     }
-    serverObject.socketBind();
-    if (serverObject.bindid < 0)
+    pending.resize(kept);
+}
+
+// Puts a client in a room, announces it there and replays what it missed.
+// A text client is shown the first page of who is there; WHO shows the rest.
+void enterRoom(int sock, string_view name, uint64_t since)
+{
+    roomId room = openRoom(name);
+    if (connections[sock].binary)
+        sendRoster(sock, room);
+    else
     {
-        exit(0);
+        string members = getAllInChat(room, 1);
+        if (!members.empty())
+            serverObject.sendMessage(sock, members + "\n");
     }
-    serverObject.serverListen();
-    if (serverObject.listenid != 0)
+    joinChat(sock, room);
+    announcePresence(sock, room, true);
+    if (name == DEFAULT_ROOM)
+        serverObject.sendMessage(sock, "You have joined the chat room.\n");
+    else
+        serverObject.sendMessage(sock, "You have joined room " + string(name) + ".\n");
+    replayHistory(sock, since);
+}
+
+// Takes a client out of its room and tells the members it left.
+void exitRoom(int sock)
+{
+    announcePresence(sock, connections[sock].room, false);
+    leaveChat(sock);
+}
+
+// Handles the reply to "Enter Alias: ": the line just received is the alias,
+// so the event loop never waits on this socket. Returns true once an alias
+// is assigned.
+bool assignAlias(int socketNumber, const string &name)
+{
+    if (name.empty())
     {
-        exit(0);
+        serverObject.sendMessage(socketNumber, "Enter Alias: ");
+        return false;
     }
-    cout << string(50, '-') << endl;
+    if (!claimAlias(socketNumber, name))
+    {
+        serverObject.sendMessage(socketNumber, "Alias already taken.\n");
+        serverObject.sendMessage(socketNumber, "Enter Alias: ");
+        return false;
+    }
+    serverObject.sendMessage(socketNumber, "Alias Assigned\n");
+    serverLog.log(LOG_INFO, YELLOW, "Assigned Socket ", socketNumber, " : ", name);
+    return true;
+}
 
-    // Set up select() variables.
-    fd_set master_set, read_fds;
-    FD_ZERO(&master_set);
-    FD_ZERO(&read_fds);
-    FD_SET(serverObject.sockfd, &master_set);
-    int fdmax = serverObject.sockfd;
+// io_uring engine state. Completions are matched to their request through
+// user_data: operation in the top byte, connection generation, then the fd.
+enum uringOp
+{
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL, // stops a deferred client's multishot recv
+    URING_TIMEOUT // wakes the loop when a deferred client is due
+};
 
-    char buffer[BUFFER_SIZE];
+uring ring;
+map<uint64_t, unique_ptr<uringSend>> retiredSends; // sends of closed sockets still owned by the kernel
 
-    // Main loop using select()
-    while (true)
+uint64_t uringTag(uringOp op, int fd, unsigned generation)
+{
+    return ((uint64_t)op << 56) | ((uint64_t)(generation & 0xFFFFFF) << 32) | (uint32_t)fd;
+}
+
+void armUringRecv(int sock)
+{
+    connections[sock].receiving = true;
+    ring.prepMultishotRecv(sock, URING_BUFFER_GROUP, uringTag(URING_RECV, sock, connections[sock].generation));
+}
+
+// Hands up to OUTPUT_IOV_MAX queued replies to the kernel as one sendmsg.
+void startUringSend(int sock)
+{
+    connection &conn = connections[sock];
+    if (!conn.send)
+        conn.send.reset(new uringSend());
+    memset(&conn.send->msg, 0, sizeof(conn.send->msg));
+    conn.send->msg.msg_iov = conn.send->iov;
+    conn.send->msg.msg_iovlen = conn.output.gather(conn.send->iov, OUTPUT_IOV_MAX);
+    conn.sending = true;
+    ring.prepSendMsg(sock, &conn.send->msg, uringTag(URING_SEND, sock, conn.generation));
+}
+
+// The kernel may still be reading an in-flight send of a socket that is being
+// closed, so its gather list and queue are kept until the completion arrives.
+// shutdown() ends the multishot receive, which would otherwise keep the socket
+// open.
+void retireUringConnection(int sock)
+{
+    connection &conn = connections[sock];
+    if (conn.sending)
     {
-        read_fds = master_set;
-        int activity = select(fdmax + 1, &read_fds, NULL, NULL, NULL);
-        if (activity < 0)
-        {
-            cout << RED << "Select error" << RESET << endl;
-            break;
-        }
-        for (int i = 0; i <= fdmax; i++)
+        conn.send->retired = move(conn.output);
+        retiredSends[uringTag(URING_SEND, sock, conn.generation)] = move(conn.send);
+    }
+    else
+    {
+        conn.output.flush(sock); // best effort goodbye
+    }
+    shutdown(sock, SHUT_RDWR);
+}
+
+void setNonBlocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Replies are only queued here; flushDirty() writes each socket's queue with
+// one gathered send at the end of the loop iteration, so a burst of messages
+// to the same client costs one syscall instead of one per message.
+ssize_t queueMessage(int sock, const messageBuffer &message, bool broadcast)
+{
+    connection &conn = connections[sock];
+    if (conn.overflowed)
+        return -1;
+    pushResult result = conn.output.push(message, broadcast, config.output);
+    if (result == PUSH_DROPPED)
+        return 0;
+    if (result == PUSH_QUEUED)
+        metrics.count(MESSAGES_QUEUED);
+    // An overflowing client is disconnected by flushConnection(), never in
+    // the middle of a fan-out over the member list.
+    if (result == PUSH_OVERFLOW)
+        conn.overflowed = true;
+    // A full batch goes out right away, so a client that keeps up never gets
+    // near its limits however many messages one wakeup fans out. Errors are
+    // left for flushConnection() to act on.
+    if (conn.output.count() >= OUTPUT_IOV_MAX && !conn.overflowed)
+    {
+        if (config.engine != URING_ENGINE)
+            conn.output.flush(sock);
+        else if (!conn.sending)
+            startUringSend(sock);
+    }
+    if (!conn.flushQueued)
+    {
+        conn.flushQueued = true;
+        currentReactor->dirty.push_back(sock);
+    }
+    return (result == PUSH_QUEUED) ? (ssize_t)message->size() : -1;
+}
+
+// Disconnects a client whose queue hit its limit under --overflow=disconnect,
+// telling it why if the socket still has room for the notice.
+void disconnectOverflowed(int sock)
+{
+    connection &conn = connections[sock];
+    serverLog.log(LOG_WARN, RED, "Socket ", sock, " is not reading its messages; disconnecting");
+    if (config.engine != URING_ENGINE || !conn.sending)
+    {
+        conn.output.flush(sock);
+        string notice = "\nDisconnected: you were not reading messages fast enough.\n";
+        send(sock, notice.c_str(), notice.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    conn.output.clear();
+    clientHungUp(sock);
+}
+
+// Writes as much of a socket's queue as it accepts without blocking. What is
+// left waits for writability: EPOLLOUT (edge-triggered, registered up front),
+// the select() write set, or the completion of the uring send.
+void flushConnection(int sock)
+{
+    connection &conn = connections[sock];
+    if (conn.overflowed)
+    {
+        disconnectOverflowed(sock);
+        return;
+    }
+    // A writable socket reports EPOLLOUT on every readable edge too; those
+    // have nothing to flush and must not count as empty-queue samples.
+    if (conn.output.empty() && !conn.writeWatched)
+        return;
+    metrics.record(QUEUE_DEPTH, conn.output.count());
+    if (config.engine == URING_ENGINE)
+    {
+        if (!conn.sending && !conn.output.empty())
+            startUringSend(sock);
+        return;
+    }
+    flushStatus status = conn.output.flush(sock);
+    if (status == FLUSH_FAILED)
+    {
+        clientHungUp(sock);
+        return;
+    }
+    bool blocked = (status == FLUSH_BLOCKED);
+    if (config.engine == SELECT_ENGINE && blocked != conn.writeWatched)
+    {
+        if (blocked)
+            FD_SET(sock, &write_set);
+        else
+            FD_CLR(sock, &write_set);
+        conn.writeWatched = blocked;
+    }
+}
+
+// Flushes every socket that had replies queued during this loop iteration.
+// Hanging up a client may queue notices for others, hence the outer loop.
+void flushDirty()
+{
+    while (!currentReactor->dirty.empty())
+    {
+        vector<int> dirty;
+        dirty.swap(currentReactor->dirty);
+        for (int sock : dirty)
         {
-            if (FD_ISSET(i, &read_fds))
-            {
-                // New connection on the server socket.
-                if (i == serverObject.sockfd)
-                {
-                    int newSock = serverObject.acceptClient();
-                    if (newSock < 0)
-                        continue;
-                    if (clientCount >= MAX_CLIENTS)
-                    {
-                        cout << RED << "Maximum Number of Clients Reached" << RESET << endl;
-                        string fullMsg = "Server is full. Try again later.\n";
-                        serverObject.sendMessage(newSock, fullMsg);
-                        close(newSock);
-                        continue;
-                    }
-                    FD_SET(newSock, &master_set);
-                    if (newSock > fdmax)
-                        fdmax = newSock;
-                    clientCount++;
-                    clientList[newSock] = ""; // Alias not assigned yet.
-                    // Immediately prompt for alias.
-                    serverObject.sendMessage(newSock, "Enter Alias: ");
-                }
-                else
-                {
-                    // Data from an existing client.
-                    memset(buffer, 0, BUFFER_SIZE);
-                    pair<ssize_t, string> receiveReturn = serverObject.receiveMessage(i, buffer);
-                    ssize_t bytesRead = receiveReturn.first;
-                    string message = receiveReturn.second;
-                    if (bytesRead <= 0)
-                    {
-                        // Client disconnected.
-                        cout << YELLOW << "Socket " << i << " hung up." << RESET << endl;
-                        // If the client was in the chat room, broadcast the disconnection.
-                        if (clientList.find(i) != clientList.end())
-                        {
-                            string alias = clientList[i];
-                            if (chatRoom.find(alias) != chatRoom.end())
-                            {
-                                string leaveMsg = msgParser(DISCONNECT, "", i);
-                                globalChat(leaveMsg);
-                                chatRoom.erase(alias);
-                            }
-                        }
-                        close(i);
-                        FD_CLR(i, &master_set);
-                        clientList.erase(i);
-                        clientCount--;
-                    }
-                    else
-                    {
-                        // Remove newline/carriage return characters.
-                        message.erase(remove(message.begin(), message.end(), '\n'), message.end());
-                        message.erase(remove(message.begin(), message.end(), '\r'), message.end());
-
-                        // If alias not yet assigned, treat the incoming message as the alias.
-                        if (clientList[i] == "")
-                        {
-                            clientAlias(i, buffer);
-                        }
-                        else if (chatRoom.find(clientList[i]) == chatRoom.end())
-                        {
-                            // Client is not in the chat room.
-                            if (message.size() >= 7 && message.substr(0, 7) == "CONNECT")
-                            {
-                                chatRoom[clientList[i]] = i;
-                                string joinMsg = msgParser(CONNECT, "", i);
-                                globalChat(joinMsg);
-                                cout << joinMsg;
-                                string confirm = "You have joined the chat room.\n";
-                                serverObject.sendMessage(i, confirm);
-                            }
-                            else if (message.size() >= 4 && message.substr(0, 4) == "EXIT")
-                            {
-                                string exitMsg = msgParser(EXIT, "", i);
-                                serverObject.sendMessage(i, exitMsg);
-                                close(i);
-                                FD_CLR(i, &master_set);
-                                clientList.erase(i);
-                                clientCount--;
-                            }
-                            else
-                            {
-                                // Not in chat room: simply acknowledge or prompt.
-                                string prompt = "Type CONNECT to join the chat room or EXIT to disconnect.\n";
-                                serverObject.sendMessage(i, prompt);
-                            }
-                        }
-                        else
-                        {
-                            // Client is in the chat room: process chat commands.
-                            vector<int> privateSocketNo;
-                            vector<string> privateAliasNotFound;
-                            msgType command = commandHandler(message, i, privateSocketNo, privateAliasNotFound);
-                            string parsedMsg = msgParser(command, message, i);
-                            cout << CYAN << "\tSending: " << parsedMsg << RESET << endl;
-                            switch (command)
-                            {
-                            case BROADCAST:
-                                broadcast(i, parsedMsg);
-                                break;
-                            case PRIVATE:
-                                privateMessage(privateSocketNo, parsedMsg);
-                                userNotPresent(privateAliasNotFound, i);
-                                break;
-                            case DISCONNECT:
-                                globalChat(parsedMsg);
-                                chatRoom.erase(clientList[i]);
-                                break;
-                            case EXIT:
-                                globalChat(parsedMsg);
-                                close(i);
-                                FD_CLR(i, &master_set);
-                                clientList.erase(i);
-                                chatRoom.erase(clientList[i]); // (if present)
-                                clientCount--;
-                                break;
-                            case CONNECT:
-                                serverObject.sendMessage(i, "You are already in the chat room.\n");
-                                break;
-                            }
-                        }
-                    }
-                }
-            }
+            if (!connections[sock].active || !connections[sock].flushQueued)
+                continue;
+            connections[sock].flushQueued = false;
+            flushConnection(sock);
         }
     }
-    serverObject.closeServer(serverObject.sockfd);
-    return 0;
-}
\ No newline at end of file
+}
+
+// Admits a freshly accepted socket into the active engine and prompts for an alias.
+void registerClient(int newSock)
+{
+    if (clientCount.fetch_add(1) >= config.maxClients || !connections.fits(newSock) || (config.engine == SELECT_ENGINE && newSock >= FD_SETSIZE))
+    {
+        clientCount--;
+        serverLog.log(LOG_WARN, RED, "Maximum Number of Clients Reached");
+        string fullMsg = "Server is full. Try again later.\n";
+        serverObject.sendMessage(newSock, fullMsg);
+        close(newSock);
+        return;
+    }
+    if (config.engine == SELECT_ENGINE)
+    {
+        FD_SET(newSock, &master_set);
+        if (newSock > fdmax)
+            fdmax = newSock;
+    }
+    else if (config.engine == EPOLL_ENGINE)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = newSock;
+        if (epoll_ctl(currentReactor->epollfd, EPOLL_CTL_ADD, newSock, &ev) < 0)
+        {
+            clientCount--;
+            serverLog.log(LOG_ERROR, RED, "Epoll registration failed");
+            close(newSock);
+            return;
+        }
+    }
+    connections[newSock] = connection();
+    connections[newSock].active = true;
+    connections[newSock].generation = ++nextGeneration;
+    connections[newSock].owner = currentReactor->index;
+    connections[newSock].input.setLimit(config.maxMessage, config.oversize);
+    if (config.heartbeat.enabled())
+    {
+        heartbeats[newSock].start(currentReactor->tick);
+        currentReactor->wheel.arm(newSock, heartbeats[newSock].firstCheck(config.heartbeat, currentReactor->tick));
+    }
+    metrics.count(CONNECTIONS_OPENED);
+    if (config.engine == URING_ENGINE)
+        armUringRecv(newSock);
+    // Immediately prompt for alias.
+    serverObject.sendMessage(newSock, "Enter Alias: ");
+}
+
+// Closes a client socket and forgets all of its state.
+void removeClient(int sock)
+{
+    if (connections[sock].output.dropped() > 0)
+        serverLog.log(LOG_WARN, YELLOW, "Socket ", sock, " missed ", connections[sock].output.dropped(), " messages (output queue full)");
+    leaveChat(sock);
+    pthread_mutex_lock(&registryMutex);
+    users.remove(connections[sock].user);
+    pthread_mutex_unlock(&registryMutex);
+    connections[sock].user = NO_USER; // ids are reused
+    currentReactor->wheel.cancel(sock);
+    if (config.engine == URING_ENGINE)
+        retireUringConnection(sock);
+    else
+        connections[sock].output.flush(sock); // best effort goodbye
+    close(sock); // also removes the socket from the epoll set
+    if (config.engine == SELECT_ENGINE)
+    {
+        FD_CLR(sock, &master_set);
+        FD_CLR(sock, &write_set);
+    }
+    connections[sock] = connection();
+    clientCount--;
+    metrics.count(CONNECTIONS_CLOSED);
+}
+
+void clientHungUp(int sock)
+{
+    serverLog.log(LOG_INFO, YELLOW, "Socket ", sock, " hung up.");
+    // If the client was in a chat room, tell the room it left.
+    if (connections[sock].room != NO_ROOM)
+    {
+        roomId room = connections[sock].room;
+        leaveChat(sock);
+        announcePresence(sock, room, false);
+    }
+    removeClient(sock);
+}
+
+// Handles one complete line received from client socket i.
+void handleMessage(int i, string message)
+{
+    // Remove newline/carriage return characters.
+    message.erase(remove(message.begin(), message.end(), '\n'), message.end());
+    message.erase(remove(message.begin(), message.end(), '\r'), message.end());
+
+    // Heard already; a PONG is not a message and does not keep a client from
+    // --idle-timeout.
+    if (message == WIRE_PONG)
+        return;
+    heartbeats[i].spoke.store(currentReactor->tick, memory_order_relaxed);
+
+    // A new client may ask for the binary protocol before anything else. The
+    // reply is the last text it receives.
+    if (message == WIRE_HELLO && connections[i].state == AWAITING_ALIAS && !connections[i].binary)
+    {
+        serverObject.sendMessage(i, WIRE_HELLO + "\n");
+        connections[i].binary = true;
+        return;
+    }
+
+    // If alias not yet assigned, treat the incoming message as the alias.
+    if (connections[i].state == AWAITING_ALIAS)
+    {
+        if (assignAlias(i, message))
+            connections[i].state = IN_LOBBY;
+    }
+    else if (connections[i].state == IN_LOBBY)
+    {
+        // Client is not in a chat room.
+        parsedCommand parsed = parseCommand(message);
+        msgType command = parsed.command;
+        if (command == CONNECT)
+        {
+            enterRoom(i, DEFAULT_ROOM, parsed.since);
+        }
+        else if (command == JOIN && !parsed.rest.empty())
+        {
+            enterRoom(i, parsed.rest, parsed.since);
+        }
+        else if (command == JOIN)
+        {
+            serverObject.sendMessage(i, "Usage: JOIN <room>, at most " + to_string(MAX_ROOM_NAME) + " characters.\n");
+        }
+        else if (command == STATS)
+        {
+            serverObject.sendMessage(i, metrics.summary() + "\n");
+        }
+        else if (command == EXIT)
+        {
+            string exitMsg = msgParser(EXIT, "", i);
+            serverObject.sendMessage(i, exitMsg);
+            removeClient(i);
+        }
+        else
+        {
+            // Not in chat room: simply acknowledge or prompt.
+            string prompt = "Type CONNECT or JOIN <room> to join a chat room, or EXIT to disconnect.\n";
+            serverObject.sendMessage(i, prompt);
+        }
+    }
+    else
+    {
+        // Client is in the chat room: process chat commands.
+        vector<recipient> privateSocketNo;
+        vector<string> privateAliasNotFound;
+        uint64_t since;
+        size_t page;
+        string line = journal.started() ? message : string(); // keeps the mentions for the journal
+        msgType command = commandHandler(message, i, privateSocketNo, privateAliasNotFound, since, page);
+        metrics.lap(RECEIVE_TO_PARSE);
+        // Formatted and framed once; every recipient shares this buffer.
+        wireMessage parsedMsg = buildMessage(command, message, i);
+        serverLog.log(LOG_DEBUG, CYAN, "\tSending: ", *parsedMsg.text);
+        // Nobody may hear from the client before they hear that it joined.
+        if ((command == BROADCAST || command == PRIVATE) && !connections[i].presence->announced(connections[i].joinBatch))
+            sendPresence(connections[i].room, nowNanos());
+        switch (command)
+        {
+        case BROADCAST:
+            connections[i].history->record(parsedMsg);
+            broadcast(i, parsedMsg);
+            metrics.lap(PARSE_TO_FANOUT);
+            break;
+        case PRIVATE:
+            privateMessage(privateSocketNo, parsedMsg);
+            metrics.lap(PARSE_TO_FANOUT);
+            journal.appendPrivate(line, message, *parsedMsg.text);
+            userNotPresent(privateAliasNotFound, i);
+            break;
+        case STATS:
+            serverObject.sendMessage(i, metrics.summary() + "\n");
+            break;
+        case WHO:
+        {
+            string members = getAllInChat(connections[i].room, page);
+            serverObject.sendMessage(i, (members.empty() ? "No roster page " + to_string(page) + "." : members) + "\n");
+            break;
+        }
+        case DISCONNECT:
+        case LEAVE:
+            exitRoom(i);
+            break;
+        case EXIT:
+            announcePresence(i, connections[i].room, false);
+            removeClient(i);
+            break;
+        case CONNECT:
+            serverObject.sendMessage(i, "You are already in the chat room.\n");
+            break;
+        case JOIN:
+            if (message.empty())
+            {
+                serverObject.sendMessage(i, "Usage: JOIN <room>, at most " + to_string(MAX_ROOM_NAME) + " characters.\n");
+            }
+            else if (openRoom(message) == connections[i].room)
+            {
+                serverObject.sendMessage(i, "You are already in room " + message + ".\n");
+            }
+            else
+            {
+                exitRoom(i);
+                enterRoom(i, message, since);
+            }
+            break;
+        }
+    }
+}
+
+// Stops reading a client until `due`. Its unread lines stay in its framer
+// and socket, so its receive window fills and TCP slows the sender down; it
+// is neither disconnected nor are its messages dropped.
+void deferClient(int sock, uint64_t due)
+{
+    connection &conn = connections[sock];
+    conn.deferred = true;
+    currentReactor->deferred.push({due, sock, conn.generation});
+    metrics.count(CLIENTS_DEFERRED);
+    if (config.engine == SELECT_ENGINE)
+        FD_CLR(sock, &master_set);
+    else if (config.engine == URING_ENGINE && conn.receiving)
+        ring.prepCancel(uringTag(URING_RECV, sock, conn.generation), uringTag(URING_CANCEL, sock, conn.generation));
+}
+
+// Defers a client whose bucket, or whose room's, has no token for another
+// message. now is read once per batch.
+bool overLimit(int sock, uint64_t now)
+{
+    connection &conn = connections[sock];
+    uint64_t wait = conn.rate.wait(config.clientLimit, now);
+    if (conn.roomRate != NULL)
+        wait = max(wait, conn.roomRate->wait(config.roomLimit, now));
+    if (wait == 0)
+        return false;
+    deferClient(sock, now + wait);
+    return true;
+}
+
+// Handles every complete message in a connection's framer; stops early if a
+// message closes the connection or the client runs over a rate limit.
+void dispatchLines(int sock)
+{
+    string_view message;
+    metrics.received();
+    connection &conn = connections[sock];
+    heartbeats[sock].heard.store(currentReactor->tick, memory_order_relaxed);
+    bool limited = config.clientLimit.enabled() || config.roomLimit.enabled();
+    uint64_t now = limited ? limiterNanos() : 0;
+    while (conn.active && !conn.deferred)
+    {
+        if (limited && conn.input.buffered() > 0 && overLimit(sock, now))
+            break;
+        int status = nextMessage(connections[sock].input, connections[sock].binary, message);
+        if (status == 0)
+            break;
+        if (status < 0)
+        {
+            serverLog.log(LOG_WARN, RED, "Socket ", sock, " sent a malformed frame");
+            clientHungUp(sock);
+            break;
+        }
+        metrics.count(MESSAGES_RECEIVED);
+        if (limited)
+        {
+            conn.rate.take(config.clientLimit, now);
+            if (conn.roomRate != NULL)
+                conn.roomRate->take(config.roomLimit, now);
+        }
+        handleMessage(sock, string(message));
+    }
+    size_t dropped = connections[sock].input.takeRejected();
+    if (dropped > 0 && connections[sock].active)
+    {
+        serverLog.log(LOG_WARN, YELLOW, "Socket ", sock, " sent ", dropped, " oversized line(s)");
+        serverObject.sendMessage(sock, oversizeNotice(dropped, config.maxMessage) + "\n");
+    }
+}
+
+void runSelectLoop()
+{
+    // Set up select() variables.
+    fd_set read_fds, write_fds;
+    FD_ZERO(&master_set);
+    FD_ZERO(&write_set);
+    FD_ZERO(&read_fds);
+    FD_SET(serverObject.sockfd, &master_set);
+    fdmax = serverObject.sockfd;
+    // A connection reset between select() and accept() must not block it.
+    setNonBlocking(serverObject.sockfd);
+
+    // Main loop using select()
+    while (true)
+    {
+        read_fds = master_set;
+        write_fds = write_set;
+        int timeout = timerTimeout();
+        struct timeval wait = {timeout / 1000, (timeout % 1000) * 1000};
+        int activity = select(fdmax + 1, &read_fds, &write_fds, NULL, (timeout < 0) ? NULL : &wait);
+        currentReactor->tick = heartbeatTick();
+        if (activity < 0)
+        {
+            serverLog.log(LOG_ERROR, RED, "Select error");
+            break;
+        }
+        for (int i = 0; i <= fdmax; i++)
+        {
+            if (FD_ISSET(i, &read_fds))
+            {
+                // New connection on the server socket.
+                if (i == serverObject.sockfd)
+                {
+                    int newSock = serverObject.acceptClient();
+                    if (newSock < 0)
+                        continue;
+                    registerClient(newSock);
+                }
+                else
+                {
+                    // Data from an existing client: one read, then every
+                    // complete message it finished. MSG_DONTWAIT keeps a
+                    // spurious wake-up from stalling the loop.
+                    ssize_t bytesRead = connections[i].input.fill(i, MSG_DONTWAIT);
+                    bool nothingYet = bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+                    if (bytesRead <= 0 && !nothingYet)
+                        clientHungUp(i); // Client disconnected.
+                    else if (bytesRead > 0)
+                    {
+                        metrics.count(BYTES_RECEIVED, bytesRead);
+                        dispatchLines(i);
+                    }
+                }
+            }
+            if (FD_ISSET(i, &write_fds) && connections[i].active)
+                flushConnection(i);
+        }
+        runTimers();
+        flushDirty();
+        metrics.flushed();
+    }
+}
+
+// Accepts every pending connection; with edge-triggered epoll the listening
+// socket only signals again once its backlog has been drained.
+void acceptPending()
+{
+    while (true)
+    {
+        struct sockaddr_in cli_addr;
+        socklen_t clilen = sizeof(cli_addr);
+        int newSock = accept4(currentReactor->listenfd, (struct sockaddr *)&cli_addr, &clilen, SOCK_NONBLOCK);
+        if (newSock < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                serverLog.log(LOG_ERROR, RED, "Server accept failed");
+            return;
+        }
+        serverLog.log(LOG_INFO, GREEN, "Server-Client Connection Established");
+        registerClient(newSock);
+    }
+}
+
+// Reads a socket until it would block, then dispatches every complete line
+// that has accumulated in the connection's input buffer. A full buffer is
+// dispatched on the way, which frees it again, so a long burst streams
+// through a bounded buffer. A deferred client is not read; resumeDeferred()
+// calls this again once it is due.
+void readPending(int sock)
+{
+    bool hungUp = false;
+    while (true)
+    {
+        if (connections[sock].deferred)
+            break;
+        if (connections[sock].input.full())
+        {
+            dispatchLines(sock);
+            if (!connections[sock].active)
+                return;
+            continue;
+        }
+        ssize_t bytesRead = connections[sock].input.fill(sock);
+        if (bytesRead > 0)
+        {
+            metrics.count(BYTES_RECEIVED, bytesRead);
+            continue;
+        }
+        if (bytesRead < 0 && errno == EINTR)
+            continue;
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        hungUp = true; // EOF or socket error
+        break;
+    }
+
+    dispatchLines(sock);
+    if (hungUp && connections[sock].active)
+        clientHungUp(sock);
+}
+
+// Event loop of one reactor. With --threads=1 this is the whole epoll engine.
+void *reactorLoop(void *arg)
+{
+    reactor *self = (reactor *)arg;
+    currentReactor = self;
+
+    setNonBlocking(self->listenfd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = self->listenfd;
+    epoll_ctl(self->epollfd, EPOLL_CTL_ADD, self->listenfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = self->wakefd;
+    epoll_ctl(self->epollfd, EPOLL_CTL_ADD, self->wakefd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    bool postsWaiting = false;
+    while (true)
+    {
+        // If a peer's queue was full, poll again shortly instead of sleeping.
+        int timeout = timerTimeout();
+        if (postsWaiting && (timeout < 0 || timeout > 1))
+            timeout = 1;
+        int ready = epoll_wait(self->epollfd, events, MAX_EVENTS, timeout);
+        self->tick = heartbeatTick();
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            serverLog.log(LOG_ERROR, RED, "Epoll wait error");
+            break;
+        }
+        for (int n = 0; n < ready; n++)
+        {
+            int fd = events[n].data.fd;
+            if (fd == self->listenfd)
+                acceptPending();
+            else if (fd == self->wakefd)
+                drainInbox();
+            else if (connections.contains(fd) && connections[fd].active)
+            {
+                if (events[n].events & EPOLLOUT)
+                    flushConnection(fd);
+                if (connections[fd].active && (events[n].events & ~EPOLLOUT))
+                    readPending(fd);
+            }
+        }
+        runTimers();
+        flushDirty();
+        metrics.flushed();
+        postsWaiting = flushPosts();
+    }
+    close(self->epollfd);
+    return NULL;
+}
+
+// Creates the event loops. Loop 0 uses the server socket; every other loop
+// binds its own SO_REUSEPORT listener so the kernel balances accepts.
+bool createReactors(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        reactor *r = new reactor();
+        r->index = i;
+        r->listenfd = (i == 0) ? serverObject.sockfd : serverObject.openListener();
+        r->epollfd = (config.engine == EPOLL_ENGINE) ? epoll_create1(0) : -1;
+        r->wakefd = eventfd(0, EFD_NONBLOCK);
+        if (r->listenfd < 0 || r->wakefd < 0 || (config.engine == EPOLL_ENGINE && r->epollfd < 0))
+        {
+            cout << RED << "Event loop " << i << " setup failed" << RESET << endl;
+            return false;
+        }
+        for (int p = 0; p < count; p++)
+            r->inbox.push_back(new spscQueue<crossMessage>(CROSS_QUEUE_SIZE));
+        r->outbox.resize(count);
+        r->wake.resize(count, false);
+        r->tick = heartbeatTick();
+        r->wheel.init(heartbeatTimer, HEARTBEAT_WHEEL_SLOTS, r->tick);
+        reactors.push_back(r);
+    }
+    currentReactor = reactors[0];
+    return true;
+}
+
+void runEpollLoop()
+{
+    for (int i = 1; i < (int)reactors.size(); i++)
+        pthread_create(&reactors[i]->thread, NULL, reactorLoop, reactors[i]);
+    reactorLoop(reactors[0]);
+}
+
+uint64_t uringTimerDue = 0; // when the armed URING_TIMEOUT fires, 0 if none is
+struct __kernel_timespec uringDelay;
+
+// Hands received bytes to a connection's framer, dispatching whenever it
+// fills up. Bytes that arrive after the client was deferred, until the
+// cancelled recv completes, and do not fit are held until it is resumed.
+void receiveUring(int sock, const char *data, size_t length)
+{
+    connection &conn = connections[sock];
+    if (!conn.held.empty())
+    {
+        conn.held.append(data, length);
+        return;
+    }
+    size_t added = conn.input.append(data, length);
+    while (added < length)
+    {
+        dispatchLines(sock);
+        if (!conn.active)
+            return;
+        if (conn.deferred && conn.input.full())
+        {
+            conn.held.assign(data + added, length - added);
+            return;
+        }
+        added += conn.input.append(data + added, length - added);
+    }
+    dispatchLines(sock);
+}
+
+uint64_t nextTimerDue();
+
+// Arms a timeout for this loop's next timer unless one that fires early
+// enough is already armed.
+void armUringTimer()
+{
+    uint64_t due = nextTimerDue();
+    if (due == UINT64_MAX || (uringTimerDue != 0 && uringTimerDue <= due))
+        return;
+    uint64_t now = nowNanos();
+    uint64_t delay = (due > now) ? due - now : 0;
+    uringDelay.tv_sec = delay / 1000000000ull;
+    uringDelay.tv_nsec = delay % 1000000000ull;
+    ring.prepTimeout(&uringDelay, uringTag(URING_TIMEOUT, 0, 0));
+    uringTimerDue = due;
+}
+
+void uringCompletion(struct io_uring_cqe *cqe)
+{
+    uringOp op = (uringOp)(cqe->user_data >> 56);
+    unsigned generation = (cqe->user_data >> 32) & 0xFFFFFF;
+    int fd = (int)(cqe->user_data & 0xFFFFFFFF);
+    int res = cqe->res;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (op == URING_ACCEPT)
+    {
+        if (res >= 0)
+        {
+            serverLog.log(LOG_INFO, GREEN, "Server-Client Connection Established");
+            registerClient(res);
+        }
+        if (!more)
+            ring.prepMultishotAccept(serverObject.sockfd, uringTag(URING_ACCEPT, 0, 0));
+        return;
+    }
+
+    if (op == URING_SEND)
+    {
+        auto retired = retiredSends.find(cqe->user_data);
+        if (retired != retiredSends.end())
+        {
+            retiredSends.erase(retired);
+            return;
+        }
+        if (!connections.contains(fd) || !connections[fd].active || (connections[fd].generation & 0xFFFFFF) != generation)
+            return;
+        connection &conn = connections[fd];
+        conn.sending = false;
+        if (res < 0)
+        {
+            clientHungUp(fd);
+            return;
+        }
+        // Anything still queued (a short send or replies queued since) goes
+        // out as the next sendmsg.
+        conn.output.consume(res);
+        if (!conn.output.empty() && !conn.flushQueued)
+        {
+            conn.flushQueued = true;
+            currentReactor->dirty.push_back(fd);
+        }
+        return;
+    }
+
+    if (op == URING_TIMEOUT)
+    {
+        uringTimerDue = 0; // runTimers() runs next and a new timeout is armed if needed
+        return;
+    }
+    if (op == URING_CANCEL)
+        return; // the cancelled recv completes on its own
+
+    // URING_RECV
+    bool current = connections.contains(fd) && connections[fd].active && (connections[fd].generation & 0xFFFFFF) == generation;
+    if (res > 0)
+    {
+        unsigned bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        metrics.count(BYTES_RECEIVED, res);
+        if (current)
+            receiveUring(fd, ring.bufferData(bufferId), res);
+        ring.recycleBuffer(bufferId);
+        current = current && connections[fd].active;
+    }
+    if (!current)
+        return;
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED))
+    {
+        clientHungUp(fd); // EOF or receive error
+        return;
+    }
+    // The multishot ended: the buffer ring ran dry or a deferral cancelled
+    // it. Re-arm unless the client is still deferred.
+    if (!more)
+    {
+        connections[fd].receiving = false;
+        if (!connections[fd].deferred)
+            armUringRecv(fd);
+    }
+}
+
+// Resumes the clients of this loop whose rate limit wait is over.
+void resumeDeferred()
+{
+    auto &deferred = currentReactor->deferred;
+    if (deferred.empty())
+        return;
+    uint64_t now = nowNanos();
+    while (!deferred.empty() && deferred.top().due <= now)
+    {
+        deferral next = deferred.top();
+        deferred.pop();
+        connection &conn = connections[next.sock];
+        if (!conn.active || conn.generation != next.generation)
+            continue; // closed while it waited
+        conn.deferred = false;
+        if (config.engine == SELECT_ENGINE)
+        {
+            FD_SET(next.sock, &master_set);
+            dispatchLines(next.sock);
+        }
+        else if (config.engine == EPOLL_ENGINE)
+        {
+            readPending(next.sock); // edge-triggered: read what arrived meanwhile
+        }
+        else
+        {
+            dispatchLines(next.sock);
+            string held;
+            held.swap(conn.held);
+            if (!held.empty())
+                receiveUring(next.sock, held.data(), held.size());
+            if (conn.active && !conn.deferred && !conn.receiving)
+                armUringRecv(next.sock);
+        }
+    }
+}
+
+// A client's heartbeat timer went off: ping it, disconnect it or check
+// again later.
+void checkHeartbeat(int sock)
+{
+    uint64_t next = 0;
+    switch (heartbeats[sock].check(config.heartbeat, currentReactor->tick, next))
+    {
+    case HEARTBEAT_PING:
+        serverObject.sendMessage(sock, pingMessage());
+        break;
+    case HEARTBEAT_DEAD:
+        serverLog.log(LOG_WARN, YELLOW, "Socket ", sock, " did not answer PING; disconnecting");
+        clientHungUp(sock);
+        return;
+    case HEARTBEAT_IDLE:
+        serverObject.sendMessage(sock, "Disconnected: no messages for too long.\n");
+        serverLog.log(LOG_INFO, YELLOW, "Socket ", sock, " was idle; disconnecting");
+        clientHungUp(sock);
+        return;
+    case HEARTBEAT_WAIT:
+        break;
+    }
+    currentReactor->wheel.arm(sock, next);
+}
+
+// Runs whatever timer work this loop has due: deferred clients, heartbeat
+// checks and presence batches.
+void runTimers()
+{
+    resumeDeferred();
+    currentReactor->wheel.advance(currentReactor->tick, checkHeartbeat);
+    runPresence();
+}
+
+// When this loop next has timer work, in CLOCK_MONOTONIC ns: a deferred
+// client falls due, a presence window closes or, while any heartbeat is
+// armed, the next tick starts. UINT64_MAX if none of these.
+uint64_t nextTimerDue()
+{
+    uint64_t due = UINT64_MAX;
+    if (!currentReactor->deferred.empty())
+        due = currentReactor->deferred.top().due;
+    if (!currentReactor->wheel.empty())
+        due = min<uint64_t>(due, (currentReactor->wheel.now() + 1) * HEARTBEAT_TICK_MS * 1000000ull);
+    for (roomId room : currentReactor->presenceRooms)
+    {
+        if (currentReactor->presence[room]->pending())
+            due = min(due, currentReactor->presence[room]->due());
+    }
+    return due;
+}
+
+// Milliseconds until nextTimerDue(), or -1 if there is none; a poll timeout.
+int timerTimeout()
+{
+    uint64_t due = nextTimerDue();
+    if (due == UINT64_MAX)
+        return -1;
+    uint64_t now = nowNanos();
+    return (due <= now) ? 0 : (int)((due - now + 999999) / 1000000);
+}
+
+void runUringLoop()
+{
+    if (!ring.init(URING_ENTRIES) || !ring.setupBufferRing(URING_BUFFER_GROUP, URING_BUFFERS, BUFFER_SIZE))
+    {
+        cout << RED << "io_uring setup failed" << RESET << endl;
+        return;
+    }
+    ring.prepMultishotAccept(serverObject.sockfd, uringTag(URING_ACCEPT, 0, 0));
+
+    while (true)
+    {
+        // Every send prepared while handling the previous batch goes out in
+        // the same io_uring_enter() that waits for the next completions.
+        runTimers();
+        armUringTimer();
+        flushDirty();
+        metrics.flushed();
+        if (ring.submit(1) < 0 && errno != EINTR)
+        {
+            serverLog.log(LOG_ERROR, RED, "io_uring wait error");
+            break;
+        }
+        currentReactor->tick = heartbeatTick();
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring.peekCqe()) != NULL)
+        {
+            struct io_uring_cqe completion = *cqe;
+            ring.cqeSeen();
+            uringCompletion(&completion);
+        }
+    }
+    ring.closeRing();
+}
+
+// Opens --journal and refills the room histories from it.
+void openJournal()
+{
+    size_t restored = 0;
+    bool opened = journal.start(config.journalDir, [&](journalKind kind, string_view room, uint64_t sequence, string_view text)
+    {
+        if (kind != JOURNAL_BROADCAST)
+            return;
+        roomId id = openRoom(room);
+        pthread_mutex_lock(&registryMutex);
+        roomHistory *history = &rooms[id]->history;
+        pthread_mutex_unlock(&registryMutex);
+        history->restore(sequence, text);
+        restored++;
+    });
+    if (!opened)
+    {
+        cout << RED << "Could not open journal " << config.journalDir << ": " << strerror(errno) << RESET << endl;
+        exit(0);
+    }
+    cout << GREEN << "Journal " << config.journalDir << " opened, " << restored << " room messages restored." << RESET << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cout << RED << "Port Number is missing" << RESET << endl;
+        config.usage(argv[0]);
+        exit(0);
+    }
+    if (!config.parse(argc, argv))
+    {
+        exit(0);
+    }
+    signal(SIGPIPE, SIG_IGN); // a peer that hung up must not kill the server
+    serverObject.getPort(argv);
+    serverObject.socketNumber();
+    if (serverObject.sockfd < 0)
+    {
+        exit(0);
+    }
+    serverObject.socketBind();
+    if (serverObject.bindid < 0)
+    {
+        exit(0);
+    }
+    serverObject.serverListen();
+    if (serverObject.listenid != 0)
+    {
+        exit(0);
+    }
+    cout << string(50, '-') << endl;
+    serverLog.start(config.logging);
+    metrics.startExporter(config.metricsFile, config.metricsInterval);
+
+    // Size the connection table to the descriptor limit.
+    struct rlimit fdLimit;
+    int maxDescriptors = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur != RLIM_INFINITY)
+        maxDescriptors = min<long>(fdLimit.rlim_cur, 1 << 20);
+    connections.init(maxDescriptors);
+    heartbeats.init(maxDescriptors);
+    if (!config.journalDir.empty())
+        openJournal();
+    if (!createReactors(config.threads))
+    {
+        exit(0);
+    }
+
+    if (config.engine == EPOLL_ENGINE)
+        runEpollLoop();
+    else if (config.engine == URING_ENGINE)
+        runUringLoop();
+    else
+        runSelectLoop();
+
+    serverLog.finish();
+    serverObject.closeServer(serverObject.sockfd);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+// Bounded single-producer/single-consumer ring. One event-loop thread pushes,
+// exactly one other pops; neither side ever takes a lock.
+
+#include <atomic>  // For std::atomic
+#include <vector>  // For std::vector
+#include <utility> // For std::move
+
+using namespace std;
+
+template <typename T>
+class spscQueue
+{
+private:
+    vector<T> slots;
+    size_t mask;
+    // Producer and consumer indices live on separate cache lines so the two
+    // threads do not invalidate each other on every operation.
+    alignas(64) atomic<size_t> head{0}; // next slot to pop (consumer)
+    alignas(64) atomic<size_t> tail{0}; // next slot to push (producer)
+
+public:
+    // capacity is rounded up to a power of two
+    explicit spscQueue(size_t capacity = 1024)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Returns false when the ring is full; the caller keeps the item.
+    bool push(T &item)
+    {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) > mask)
+            return false;
+        slots[t & mask] = move(item);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire))
+            return false;
+        item = move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer side: true if there is nothing to pop.
+    bool empty() const
+    {
+        return head.load(memory_order_relaxed) == tail.load(memory_order_acquire);
+    }
+};
+
+#endif
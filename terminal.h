@@ -1,15 +1,171 @@
 #include <ncurses.h>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <fstream>
+#include <time.h>
 
 using namespace std;
 
+#define HISTORY_LINES 5000 // rows kept in memory for scrolling back
+#define FRAME_MILLIS 33    // at most ~30 chat redraws a second
+
+// Fixed-capacity ring of chat rows, oldest first. Pushing into a full ring
+// hands back the row it displaced.
+class historyRing
+{
+private:
+    vector<string> rows;
+    size_t first = 0; // slot of the oldest row
+    size_t count = 0;
+
+public:
+    explicit historyRing(size_t capacity) : rows(capacity) {}
+
+    // Returns true and fills evicted when the oldest row had to go.
+    bool push(string row, string &evicted)
+    {
+        if (count < rows.size())
+        {
+            rows[(first + count++) % rows.size()] = move(row);
+            return false;
+        }
+        evicted = move(rows[first]);
+        rows[first] = move(row);
+        first = (first + 1) % rows.size();
+        return true;
+    }
+
+    const string &operator[](size_t i) const
+    {
+        return rows[(first + i) % rows.size()];
+    }
+
+    int size() const
+    {
+        return count;
+    }
+};
+
+// Chat window with a bounded scrollback and an input line. Incoming lines
+// are wrapped into rows and kept in a ring; rows that fall out of it can be
+// spilled to a file. Drawing is incremental and rate-limited: a new row
+// scrolls the window by one line and only that row is printed, and however
+// many rows arrive, the window is redrawn at most once per FRAME_MILLIS.
+// Rows that arrive in between are drawn by the next frame; the caller's
+// event loop waits at most frameTimeout() and then calls renderIfDue().
+// Input never blocks: pollInput() takes whatever keys are waiting.
 class terminal
 {
 private:
-    WINDOW *chatWin, *inputWin;
-    vector<string> chat_history;
-    int chat_scroll_offset = 0;
+    WINDOW *chatWin = NULL, *chatText = NULL, *inputWin = NULL; // chatText is the inside of chatWin's border
+    historyRing chat_history{HISTORY_LINES};
+    int chat_scroll_offset = 0; // rows between the bottom of the view and the newest row
+    int unrendered = 0;         // rows added since the last frame, view at the bottom
+    bool fullRedraw = true;
+    long lastFrame = 0; // ms
+    ofstream spill;
+    string input;       // line being typed
+    int cursor_pos = 0; // in input
+
+    static long nowMillis()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+    }
+
+    int visibleRows()
+    {
+        return getmaxy(chatText);
+    }
+
+    int maxOffset()
+    {
+        return max(0, chat_history.size() - visibleRows());
+    }
+
+    void addRow(string row)
+    {
+        string evicted;
+        if (chat_history.push(move(row), evicted) && spill.is_open())
+            spill << evicted << '\n';
+        if (chat_scroll_offset > 0)
+            chat_scroll_offset = min(chat_scroll_offset + 1, maxOffset()); // keep the view where the user left it
+        else
+            unrendered++;
+    }
+
+    // Splits a message into rows that fit the window.
+    void addRows(const string &msg)
+    {
+        size_t width = max(1, getmaxx(chatText));
+        size_t start = 0;
+        while (true)
+        {
+            size_t end = msg.find('\n', start);
+            string line = msg.substr(start, (end == string::npos) ? string::npos : end - start);
+            if (line.empty())
+                addRow(line);
+            for (size_t i = 0; i < line.size(); i += width)
+                addRow(line.substr(i, width));
+            if (end == string::npos)
+                break;
+            start = end + 1;
+        }
+    }
+
+    void drawRow(int y, int row)
+    {
+        wmove(chatText, y, 0);
+        wclrtoeol(chatText);
+        waddnstr(chatText, chat_history[row].c_str(), getmaxx(chatText));
+    }
+
+    void redrawChat()
+    {
+        werase(chatText);
+        chat_scroll_offset = min(chat_scroll_offset, maxOffset());
+        int rows = visibleRows();
+        int start = max(0, chat_history.size() - rows - chat_scroll_offset);
+        for (int i = 0; i < rows && start + i < chat_history.size(); i++)
+            drawRow(i, start + i);
+        fullRedraw = false;
+        unrendered = 0;
+    }
+
+    // Draws the rows added since the last frame.
+    void render()
+    {
+        int rows = visibleRows();
+        if (fullRedraw || unrendered >= rows)
+            redrawChat();
+        else
+        {
+            for (int row = chat_history.size() - unrendered; row < chat_history.size(); row++)
+            {
+                if (row < rows)
+                    drawRow(row, row); // window not full yet
+                else
+                {
+                    wscrl(chatText, 1);
+                    drawRow(rows - 1, row);
+                }
+            }
+            unrendered = 0;
+        }
+        wnoutrefresh(chatText);
+        wnoutrefresh(inputWin); // leaves the cursor in the input line
+        doupdate();
+        lastFrame = nowMillis();
+    }
+
+    void scrollTo(int offset)
+    {
+        chat_scroll_offset = max(0, min(offset, maxOffset()));
+        fullRedraw = true;
+        render();
+    }
 
 public:
     terminal() { initNcurses(); }
@@ -17,6 +173,8 @@ public:
 
     void initNcurses()
     {
+        if (chatWin != NULL)
+            return;
         initscr();
         cbreak();
         noecho();
@@ -25,58 +183,70 @@ public:
 
         int chat_height = LINES - 3;
         chatWin = newwin(chat_height, COLS, 0, 0);
+        chatText = derwin(chatWin, max(1, chat_height - 2), max(1, COLS - 4), 1, 2);
         inputWin = newwin(3, COLS, chat_height, 0);
 
         keypad(chatWin, TRUE);
         keypad(inputWin, TRUE);
-        scrollok(chatWin, TRUE);
+        scrollok(chatText, TRUE);
         scrollok(inputWin, FALSE);
+        nodelay(inputWin, TRUE); // pollInput() never waits for a key
 
+        box(chatWin, 0, 0);
+        wrefresh(chatWin);
         box(inputWin, 0, 0);
         wrefresh(inputWin);
     }
 
-    void redrawChat()
+    // Appends rows that scroll out of the in-memory history to path.
+    bool spillTo(const string &path)
     {
-        wclear(chatWin);
-        box(chatWin, 0, 0);
-
-        int chat_height, chat_width;
-        getmaxyx(chatWin, chat_height, chat_width);
-
-        int max_offset = max(0, (int)chat_history.size() - (chat_height - 2));
-        chat_scroll_offset = min(chat_scroll_offset, max_offset);
+        spill.open(path, ios::app);
+        return spill.is_open();
+    }
 
-        int start = max(0, (int)chat_history.size() - (chat_height - 2) - chat_scroll_offset);
-        for (int i = 0; i < chat_height - 2 && start + i < (int)chat_history.size(); i++)
-        {
-            mvwprintw(chatWin, i + 1, 2, "%s", chat_history[start + i].c_str());
-        }
+    void consoleStatement(const string &msg)
+    {
+        addRows(msg);
+        renderIfDue();
+    }
 
-        wrefresh(chatWin);
+    void renderIfDue()
+    {
+        if ((fullRedraw || unrendered > 0) && nowMillis() - lastFrame >= FRAME_MILLIS)
+            render();
     }
 
-    void consoleStatement(const string &msg)
+    // Milliseconds until rows waiting to be drawn are due, or -1 if none are
+    // waiting; a poll() timeout.
+    int frameTimeout()
     {
-        chat_history.push_back(msg);
-        redrawChat();
+        if (!fullRedraw && unrendered == 0)
+            return -1;
+        return max(0L, lastFrame + FRAME_MILLIS - nowMillis());
     }
 
-    string getInput()
+    // Handles the keys typed so far without waiting for more. Returns true
+    // with line set when Enter completes a line; call again until it
+    // returns false, as further keys may already be buffered.
+    bool pollInput(string &line)
     {
-        string input;
         int ch;
-        int cursor_pos = 0;
         int max_width = COLS - 4;
         MEVENT event;
 
-        while (true)
+        while ((ch = wgetch(inputWin)) != ERR)
         {
-            ch = wgetch(inputWin);
-
             if (ch == '\n')
             {
-                break;
+                line = input;
+                input.clear();
+                cursor_pos = 0;
+                werase(inputWin);
+                box(inputWin, 0, 0);
+                wrefresh(inputWin);
+                consoleStatement("You: " + line);
+                return true;
             }
             else if (ch == KEY_BACKSPACE || ch == 127)
             {
@@ -88,44 +258,28 @@ public:
             }
             else if (ch == KEY_UP) // Scroll Up
             {
-                if (chat_scroll_offset < (int)chat_history.size() - (LINES - 5))
-                {
-                    chat_scroll_offset++;
-                    redrawChat();
-                }
+                scrollTo(chat_scroll_offset + 1);
             }
             else if (ch == KEY_DOWN) // Scroll Down
             {
-                if (chat_scroll_offset > 0)
-                {
-                    chat_scroll_offset--;
-                    redrawChat();
-                }
+                scrollTo(chat_scroll_offset - 1);
             }
             else if (ch == KEY_PPAGE) // Page Up (Go to the top)
             {
-                chat_scroll_offset = (int)chat_history.size() - (LINES - 5);
-                redrawChat();
+                scrollTo(maxOffset());
             }
             else if (ch == KEY_NPAGE) // Page Down (Go to the bottom)
             {
-                chat_scroll_offset = 0;
-                redrawChat();
+                scrollTo(0);
             }
             else if (ch == KEY_MOUSE)
             {
                 if (getmouse(&event) == OK)
                 {
                     if (event.bstate & BUTTON4_PRESSED) // Scroll Up
-                    {
-                        chat_scroll_offset = min(chat_scroll_offset + 2, (int)chat_history.size() - (LINES - 5));
-                        redrawChat();
-                    }
+                        scrollTo(chat_scroll_offset + 2);
                     else if (event.bstate & BUTTON5_PRESSED) // Scroll Down
-                    {
-                        chat_scroll_offset = max(chat_scroll_offset - 2, 0);
-                        redrawChat();
-                    }
+                        scrollTo(chat_scroll_offset - 2);
                 }
                 continue;
             }
@@ -134,32 +288,31 @@ public:
                 // Ignore Irrelevant Keys
                 continue;
             }
-            else if (ch != ERR && input.length() < max_width)
+            else if ((int)input.length() < max_width)
             {
                 input.insert(cursor_pos, 1, ch);
                 cursor_pos++;
             }
 
-            wclear(inputWin);
+            werase(inputWin);
             box(inputWin, 0, 0);
             mvwprintw(inputWin, 1, 2, "%s", input.c_str());
             wmove(inputWin, 1, cursor_pos + 2);
             wrefresh(inputWin);
         }
-
-        wclear(inputWin);
-        box(inputWin, 0, 0);
-        wrefresh(inputWin);
-        consoleStatement("You: " + input);
-        return input;
+        return false;
     }
 
     void closeTerminal()
     {
+        if (chatWin == NULL)
+            return;
         wclear(chatWin);
         wrefresh(chatWin);
+        delwin(chatText);
         delwin(chatWin);
         delwin(inputWin);
         endwin();
+        chatWin = chatText = inputWin = NULL;
     }
 };
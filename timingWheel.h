@@ -0,0 +1,129 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+// Hashed timing wheel of per-connection timers, keyed by socket.
+//
+// Time is counted in ticks. The wheel is a ring of slots, each the head of a
+// doubly linked list threaded through the wheelTimer kept in each socket's
+// own state; a timer due at tick t lives in slot t % slots, however many
+// turns ahead that is. Arming, re-arming and cancelling only link or unlink
+// one timer, so they cost the same with ten clients or a million, and
+// advancing by a tick walks one slot: the timers due in it and the few that
+// wait for a later turn. Nothing ever scans the whole connection table.
+//
+// A wheel is used by one thread at a time.
+
+#include <vector>    // For std::vector
+#include <algorithm> // For std::min, std::max
+#include <cstdint>   // For uint64_t
+
+using namespace std;
+
+// One socket's links in the wheel.
+struct wheelTimer
+{
+    int prev = -1;
+    int next = -1;
+    uint64_t due = 0;
+    bool armed = false;
+};
+
+class timingWheel
+{
+private:
+    wheelTimer &(*timerOf)(int id) = NULL; // finds a socket's wheelTimer
+    vector<int> slots;    // first socket of each slot, -1 if empty
+    uint64_t current = 0; // last tick advanced to
+    size_t armedCount = 0;
+    vector<int> expired; // reused by advance()
+
+    size_t slotOf(uint64_t tick) const
+    {
+        return tick & (slots.size() - 1);
+    }
+
+    void unlink(int id)
+    {
+        wheelTimer &n = timerOf(id);
+        if (n.prev >= 0)
+            timerOf(n.prev).next = n.next;
+        else
+            slots[slotOf(n.due)] = n.next;
+        if (n.next >= 0)
+            timerOf(n.next).prev = n.prev;
+        n.prev = n.next = -1;
+        n.armed = false;
+        armedCount--;
+    }
+
+public:
+    // slotCount must be a power of two.
+    void init(wheelTimer &(*lookup)(int id), size_t slotCount, uint64_t now)
+    {
+        timerOf = lookup;
+        slots.assign(slotCount, -1);
+        current = now;
+    }
+
+    // Sets id's timer to go off at tick `due` (at the next tick if that has
+    // passed), replacing any earlier setting.
+    void arm(int id, uint64_t due)
+    {
+        if (timerOf(id).armed)
+            unlink(id);
+        wheelTimer &n = timerOf(id);
+        n.due = max(due, current + 1);
+        n.prev = -1;
+        n.next = slots[slotOf(n.due)];
+        if (n.next >= 0)
+            timerOf(n.next).prev = id;
+        slots[slotOf(n.due)] = id;
+        n.armed = true;
+        armedCount++;
+    }
+
+    void cancel(int id)
+    {
+        if (timerOf(id).armed)
+            unlink(id);
+    }
+
+    // Moves the wheel to tick `now` and calls visit(id) for every timer due
+    // by then, each already disarmed. visit may arm timers again.
+    template <typename F>
+    void advance(uint64_t now, F visit)
+    {
+        if (now <= current)
+            return;
+        // After a long stall every slot is walked once, not once per tick.
+        uint64_t steps = min<uint64_t>(now - current, slots.size());
+        for (uint64_t tick = current + 1; tick <= current + steps; tick++)
+        {
+            for (int id = slots[slotOf(tick)]; id >= 0; id = timerOf(id).next)
+            {
+                if (timerOf(id).due <= now)
+                    expired.push_back(id);
+            }
+        }
+        current = now;
+        // Unlinked before any is visited, so the walk above is never
+        // disturbed by a callback.
+        for (int id : expired)
+            unlink(id);
+        for (int id : expired)
+            visit(id);
+        expired.clear();
+    }
+
+    uint64_t now() const
+    {
+        return current;
+    }
+
+    bool empty() const
+    {
+        return armedCount == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef URING_H
+#define URING_H
+
+// Minimal io_uring wrapper built directly on the kernel interface, so the
+// server needs no extra library. Only what the chat server uses is here:
+// submission/completion rings and one provided buffer ring for reads.
+
+#include <linux/io_uring.h> // For io_uring structures and opcodes
+#include <sys/syscall.h>    // For __NR_io_uring_* syscall numbers
+#include <sys/mman.h>       // For mmap(), munmap()
+#include <sys/socket.h>     // For MSG_NOSIGNAL, SOCK_NONBLOCK
+#include <unistd.h>         // For syscall(), close()
+#include <cstring>          // For memset()
+#include <cstdint>          // For uint64_t
+
+class uring
+{
+private:
+    int ringfd = -1;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqEntries;
+    unsigned sqLocalTail = 0; // entries prepared but not yet published
+    unsigned sqSubmitted = 0; // entries published to the kernel so far
+
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *bufRing = NULL;
+    unsigned bufEntries = 0;
+    char *bufBase = NULL;
+    unsigned bufSize = 0;
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags, NULL, 0);
+    }
+
+public:
+    bool init(unsigned entries)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringfd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ringfd < 0)
+            return false;
+
+        size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap && cqRingSize > sqRingSize)
+            sqRingSize = cqRingSize;
+
+        char *sqRing = (char *)mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        char *cqRing = sqRing;
+        if (!singleMmap)
+        {
+            cqRing = (char *)mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED)
+                return false;
+        }
+        sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+
+        sqHead = (unsigned *)(sqRing + params.sq_off.head);
+        sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+        sqMask = (unsigned *)(sqRing + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sqRing + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        sqLocalTail = sqSubmitted = *sqTail;
+
+        cqHead = (unsigned *)(cqRing + params.cq_off.head);
+        cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+        cqMask = (unsigned *)(cqRing + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+        return true;
+    }
+
+    // Registers `count` buffers of `size` bytes as provided buffer group `groupId`.
+    // Multishot receives pick a buffer from this ring instead of owning one each.
+    bool setupBufferRing(unsigned short groupId, unsigned count, unsigned size)
+    {
+        // The ring is shared with the kernel, so it gets its own mapping
+        // rather than heap memory.
+        void *ringMem = mmap(NULL, count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ringMem == MAP_FAILED)
+            return false;
+        bufRing = (struct io_uring_buf_ring *)ringMem;
+        bufEntries = count;
+        bufSize = size;
+        bufBase = new char[(size_t)count * size];
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+        reg.ring_entries = count;
+        reg.bgid = groupId;
+        if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+
+        for (unsigned i = 0; i < count; i++)
+            recycleBuffer(i, false);
+        __atomic_store_n(&bufRing->tail, (unsigned short)count, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    char *bufferData(unsigned bufferId)
+    {
+        return bufBase + (size_t)bufferId * bufSize;
+    }
+
+    // Hands a consumed buffer back to the kernel.
+    void recycleBuffer(unsigned bufferId, bool publish = true)
+    {
+        unsigned short tail = bufRing->tail;
+        unsigned index = publish ? tail : bufferId;
+        // Index the ring as a plain array: in C++ the uapi flexible-array
+        // wrapper shifts `bufs` by one byte.
+        struct io_uring_buf *buf = &((struct io_uring_buf *)bufRing)[index & (bufEntries - 1)];
+        buf->addr = (uint64_t)(uintptr_t)bufferData(bufferId);
+        buf->len = bufSize;
+        buf->bid = (unsigned short)bufferId;
+        if (publish)
+            __atomic_store_n(&bufRing->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // Returns a zeroed submission entry, flushing the queue first if it is full.
+    struct io_uring_sqe *getSqe()
+    {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (sqLocalTail - head >= sqEntries)
+        {
+            submit(0);
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (sqLocalTail - head >= sqEntries)
+                return NULL;
+        }
+        unsigned index = sqLocalTail & *sqMask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        sqLocalTail++;
+        return sqe;
+    }
+
+    // Publishes every prepared entry with a single io_uring_enter() and
+    // optionally waits for `waitFor` completions.
+    int submit(unsigned waitFor)
+    {
+        unsigned toSubmit = sqLocalTail - sqSubmitted;
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        sqSubmitted = sqLocalTail;
+        if (toSubmit == 0 && waitFor == 0)
+            return 0;
+        return enter(toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0);
+    }
+
+    // Returns the next completion or NULL; call cqeSeen() once it is handled.
+    struct io_uring_cqe *peekCqe()
+    {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            return NULL;
+        return &cqes[head & *cqMask];
+    }
+
+    void cqeSeen()
+    {
+        __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+    }
+
+    void prepMultishotAccept(int listenfd, uint64_t tag)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenfd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        sqe->user_data = tag;
+    }
+
+    void prepMultishotRecv(int sock, unsigned short groupId, uint64_t tag)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sock;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = groupId;
+        sqe->user_data = tag;
+    }
+
+    // Gathered send; msg and its iovecs must stay valid until the completion.
+    void prepSendMsg(int sock, const struct msghdr *msg, uint64_t tag)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sock;
+        sqe->addr = (uint64_t)(uintptr_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag;
+    }
+
+    // Asks the kernel to cancel the request submitted with `target`; it then
+    // completes with -ECANCELED.
+    void prepCancel(uint64_t target, uint64_t tag)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = tag;
+    }
+
+    // Completes with -ETIME once *delay has passed; delay must stay valid
+    // until then.
+    void prepTimeout(const struct __kernel_timespec *delay, uint64_t tag)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL)
+            return;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)delay;
+        sqe->len = 1;
+        sqe->user_data = tag;
+    }
+
+    void closeRing()
+    {
+        if (ringfd >= 0)
+            close(ringfd);
+        ringfd = -1;
+    }
+};
+
+#endif
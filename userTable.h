@@ -0,0 +1,169 @@
+#ifndef USER_TABLE_H
+#define USER_TABLE_H
+
+// Interned aliases with dense integer user ids. Looking an alias up hashes it
+// once and probes a flat open-addressing array; everything else refers to the
+// user by id, so per-message lookups are array indexing instead of map walks
+// with string compares. Ids of removed users are reused, which keeps the
+// table as small as the busiest moment. Not thread-safe; callers lock.
+// Room names are interned the same way.
+
+#include <string>      // For std::string
+#include <string_view> // For std::string_view
+#include <vector>      // For std::vector
+#include <cstdint>     // For uint32_t
+
+using namespace std;
+
+typedef uint32_t userId;
+#define NO_USER 0 // ids start at 1
+typedef uint32_t roomId;
+#define NO_ROOM 0
+
+template <typename T>
+class userTable
+{
+private:
+    struct slot
+    {
+        uint32_t hash;
+        userId id; // NO_USER marks an empty slot
+    };
+    struct user
+    {
+        string alias;
+        T data;
+        bool used = false;
+    };
+
+    vector<slot> slots; // size is a power of two, at most half full
+    vector<user> users; // indexed by id; users[NO_USER] is never used
+    vector<userId> freeIds;
+    size_t count = 0;
+
+    // FNV-1a
+    static uint32_t hashAlias(string_view alias)
+    {
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : alias)
+            hash = (hash ^ c) * 16777619u;
+        return hash;
+    }
+
+    size_t mask() const
+    {
+        return slots.size() - 1;
+    }
+
+    void place(uint32_t hash, userId id)
+    {
+        size_t i = hash & mask();
+        while (slots[i].id != NO_USER)
+            i = (i + 1) & mask();
+        slots[i] = {hash, id};
+    }
+
+    void grow()
+    {
+        vector<slot> old;
+        old.swap(slots);
+        slots.assign(old.size() * 2, {0, NO_USER});
+        for (const slot &s : old)
+            if (s.id != NO_USER)
+                place(s.hash, s.id);
+    }
+
+public:
+    userTable() : slots(16, {0, NO_USER}), users(1) {}
+
+    // Returns the user's id, or NO_USER if nobody has this alias.
+    userId find(string_view alias) const
+    {
+        uint32_t hash = hashAlias(alias);
+        for (size_t i = hash & mask(); slots[i].id != NO_USER; i = (i + 1) & mask())
+        {
+            if (slots[i].hash == hash && users[slots[i].id].alias == alias)
+                return slots[i].id;
+        }
+        return NO_USER;
+    }
+
+    // Interns a new alias. Returns its id, or NO_USER if the alias is taken.
+    userId add(const string &alias, const T &data = T())
+    {
+        if (find(alias) != NO_USER)
+            return NO_USER;
+        if ((count + 1) * 2 > slots.size())
+            grow();
+        userId id;
+        if (!freeIds.empty())
+        {
+            id = freeIds.back();
+            freeIds.pop_back();
+        }
+        else
+        {
+            id = users.size();
+            users.emplace_back();
+        }
+        users[id].alias = alias;
+        users[id].data = data;
+        users[id].used = true;
+        place(hashAlias(alias), id);
+        count++;
+        return id;
+    }
+
+    void remove(userId id)
+    {
+        if (!contains(id))
+            return;
+        size_t i = hashAlias(users[id].alias) & mask();
+        while (slots[i].id != id)
+            i = (i + 1) & mask();
+        // Backward-shift deletion: pull later entries of the probe run into
+        // the hole so lookups never need tombstones.
+        slots[i].id = NO_USER;
+        for (size_t j = (i + 1) & mask(); slots[j].id != NO_USER; j = (j + 1) & mask())
+        {
+            size_t home = slots[j].hash & mask();
+            if (((j - home) & mask()) >= ((j - i) & mask()))
+            {
+                slots[i] = slots[j];
+                slots[j].id = NO_USER;
+                i = j;
+            }
+        }
+        users[id] = user();
+        freeIds.push_back(id);
+        count--;
+    }
+
+    bool contains(userId id) const
+    {
+        return id < users.size() && users[id].used;
+    }
+
+    const string &alias(userId id) const
+    {
+        return users[id].alias;
+    }
+
+    T &operator[](userId id)
+    {
+        return users[id].data;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    // One past the highest id handed out so far, for walking every user.
+    userId endId() const
+    {
+        return users.size();
+    }
+};
+
+#endif
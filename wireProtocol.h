@@ -0,0 +1,139 @@
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H
+
+// Optional binary framing, negotiated when a client connects. A client that
+// wants it sends WIRE_HELLO as its very first line; the server answers with
+// the same line and from then on both directions carry only frames:
+//
+//   uint32 length   big-endian, bytes that follow (type + sender + payload)
+//   uint8  type     frameType
+//   uint32 sender   big-endian id of the client the message is from (0: server)
+//   payload         raw bytes, no escaping and no delimiter
+//
+// Clients that never send the hello keep the newline-delimited text
+// protocol. Either way the server checks on silent clients with a PING
+// (heartbeat.h); a text client answers with a WIRE_PONG line, a binary one
+// with a FRAME_PONG. Binary clients get message bodies and sender ids instead of
+// "[alias, to ALL] ..." strings and format them locally.
+
+#include <string>      // For std::string
+#include <string_view> // For std::string_view
+#include <cstdint>     // For uint8_t, uint32_t
+
+#include "messageBuffer.h"
+#include "framer.h"
+
+using namespace std;
+
+// Starts with a NUL byte, which never appears in a typed alias or message.
+#define WIRE_HELLO string("\0CHAT-BINARY 1", 14)
+#define WIRE_HEADER_SIZE 9       // length + type + sender
+#define WIRE_MAX_FRAME (1 << 16) // largest accepted length field
+#define WIRE_PING "PING" // server -> text client heartbeat line
+// Text client -> server answer. Starts with a NUL byte like WIRE_HELLO, so a
+// user who types "PONG" as a message or an alias is never taken for one.
+#define WIRE_PONG string("\0PONG", 5)
+
+enum frameType : uint8_t
+{
+    FRAME_LINE = 0,      // client -> server: one input line (alias, command or message)
+    FRAME_NOTICE = 1,    // server -> client: server text (prompts, errors, confirmations)
+    FRAME_BROADCAST = 2, // message to the whole room; payload is the body
+    FRAME_PRIVATE = 3,   // message to selected members; payload is the body
+    FRAME_JOIN = 4,      // sender joined the room; payload is its alias
+    FRAME_LEAVE = 5,     // sender left the room; payload is its alias
+    FRAME_MEMBER = 6,    // sender is already in the room (sent to a joiner); payload is its alias
+    FRAME_PING = 7,      // server -> client: heartbeat, answer with FRAME_PONG
+    FRAME_PONG = 8       // client -> server: heartbeat answer, no payload
+};
+
+inline void putUint32(string &out, uint32_t value)
+{
+    out += (char)(value >> 24);
+    out += (char)(value >> 16);
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+inline uint32_t getUint32(const char *in)
+{
+    const unsigned char *bytes = (const unsigned char *)in;
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+inline string encodeFrame(frameType type, uint32_t sender, const string &payload)
+{
+    string frame;
+    frame.reserve(WIRE_HEADER_SIZE + payload.size());
+    putUint32(frame, 5 + payload.size());
+    frame += (char)type;
+    putUint32(frame, sender);
+    frame += payload;
+    return frame;
+}
+
+// A frame as returned by framer::nextSized(): the bytes after the length.
+struct wireFrame
+{
+    frameType type;
+    uint32_t sender;
+    string_view payload;
+};
+
+// Splits a record from framer::nextSized(). Returns false if it is too short.
+inline bool decodeFrame(string_view record, wireFrame &frame)
+{
+    if (record.size() < 5)
+        return false;
+    frame.type = (frameType)record[0];
+    frame.sender = getUint32(record.data() + 1);
+    frame.payload = record.substr(5);
+    return true;
+}
+
+// Takes the next input line from a client's framer in whichever protocol it
+// speaks. Returns 1, 0 if more bytes are needed, or -1 if a binary client
+// sent a malformed or oversized frame.
+inline int nextMessage(framer &input, bool binary, string_view &message)
+{
+    if (!binary)
+        return input.next(message) ? 1 : 0;
+    string_view record;
+    wireFrame frame;
+    while (true)
+    {
+        int status = input.nextSized(record, WIRE_MAX_FRAME);
+        if (status <= 0)
+            return status;
+        if (!decodeFrame(record, frame))
+            return -1;
+        if (frame.type == FRAME_LINE)
+        {
+            message = frame.payload;
+            return 1;
+        }
+        // Other frame types carry nothing a server acts on.
+    }
+}
+
+// One outgoing chat message in both encodings, each built once and shared by
+// every recipient that speaks it.
+struct wireMessage
+{
+    messageBuffer text;
+    messageBuffer binary;
+
+    const messageBuffer &forClient(bool binaryClient) const
+    {
+        return binaryClient ? binary : text;
+    }
+};
+
+// The server's heartbeat PING in both encodings.
+inline const wireMessage &pingMessage()
+{
+    static const wireMessage ping = {makeMessage(string(WIRE_PING) + "\n"), makeMessage(encodeFrame(FRAME_PING, 0, ""))};
+    return ping;
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+// Fixed-size pool of worker threads with one task deque per worker. Tasks are
+// dealt round-robin; a worker whose deque is empty steals from the back of
+// the others before going to sleep until the next submit().
+
+#include <pthread.h> // For pthreads
+#include <deque>     // For std::deque
+#include <vector>    // For std::vector
+#include <atomic>    // For std::atomic
+
+using namespace std;
+
+class workerPool
+{
+private:
+    struct workerQueue
+    {
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        deque<void *> tasks;
+    };
+
+    void (*handler)(void *) = NULL;
+    vector<workerQueue *> queues;
+    vector<pthread_t> threads;
+    atomic<unsigned> nextQueue{0};
+
+    // Sleeping workers wait here until a task is submitted. A worker notes
+    // submitted before looking for work and sleeps only if it is unchanged,
+    // so a task pushed during the search is never slept through.
+    pthread_mutex_t idleMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+    atomic<unsigned> submitted{0};
+
+    struct workerArgs
+    {
+        workerPool *pool;
+        int index;
+    };
+
+    bool popFront(int index, void *&task)
+    {
+        workerQueue *q = queues[index];
+        pthread_mutex_lock(&q->mutex);
+        bool found = !q->tasks.empty();
+        if (found)
+        {
+            task = q->tasks.front();
+            q->tasks.pop_front();
+        }
+        pthread_mutex_unlock(&q->mutex);
+        return found;
+    }
+
+    // Without wait, gives up on a locked deque and sets busy instead.
+    bool stealBack(int index, void *&task, bool wait, bool &busy)
+    {
+        workerQueue *q = queues[index];
+        if (wait)
+            pthread_mutex_lock(&q->mutex);
+        else if (pthread_mutex_trylock(&q->mutex) != 0)
+        {
+            busy = true; // its owner is busy with it; try the next victim
+            return false;
+        }
+        bool found = !q->tasks.empty();
+        if (found)
+        {
+            task = q->tasks.back();
+            q->tasks.pop_back();
+        }
+        pthread_mutex_unlock(&q->mutex);
+        return found;
+    }
+
+    bool nextTask(int index, void *&task)
+    {
+        if (popFront(index, task))
+            return true;
+        // Try each victim without waiting, then, if any was locked, once more
+        // waiting for the locks, so nothing is left behind when we sleep.
+        bool busy = false;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int i = 1; i < (int)queues.size(); i++)
+            {
+                if (stealBack((index + i) % queues.size(), task, pass == 1, busy))
+                    return true;
+            }
+            if (!busy)
+                break;
+        }
+        return false;
+    }
+
+    void run(int index)
+    {
+        void *task;
+        while (true)
+        {
+            unsigned seen = submitted.load();
+            if (nextTask(index, task))
+            {
+                handler(task);
+                continue;
+            }
+            pthread_mutex_lock(&idleMutex);
+            while (submitted.load() == seen)
+                pthread_cond_wait(&idleCond, &idleMutex);
+            pthread_mutex_unlock(&idleMutex);
+        }
+    }
+
+    static void *threadMain(void *arg)
+    {
+        workerArgs *args = (workerArgs *)arg;
+        args->pool->run(args->index);
+        delete args;
+        return NULL;
+    }
+
+public:
+    // Starts `count` workers that call taskHandler(task) for every submitted task.
+    void start(int count, void (*taskHandler)(void *))
+    {
+        handler = taskHandler;
+        for (int i = 0; i < count; i++)
+            queues.push_back(new workerQueue());
+        threads.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            pthread_create(&threads[i], NULL, threadMain, new workerArgs{this, i});
+            pthread_detach(threads[i]);
+        }
+    }
+
+    void submit(void *task)
+    {
+        workerQueue *q = queues[nextQueue++ % queues.size()];
+        pthread_mutex_lock(&q->mutex);
+        q->tasks.push_back(task);
+        pthread_mutex_unlock(&q->mutex);
+
+        pthread_mutex_lock(&idleMutex);
+        submitted++; // after the push, so a worker that sees it finds the task
+        pthread_cond_signal(&idleCond);
+        pthread_mutex_unlock(&idleMutex);
+    }
+};
+
+#endif